@@ -0,0 +1,146 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include "config.h"
+#include "HeaderDiff.h"
+
+/* A field of a fixed header, as a mask over consecutive 32-bit words. Fields
+ * spanning several words (addresses) are entirely covered by them. */
+struct RawField {
+	/* Index of the field in the libcrafter layer */
+	byte id;
+	byte word;
+	byte words;
+	uint32_t mask;
+};
+
+/* Fixed headers, as libcrafter defines their fields */
+template <int Proto> struct FixedLayout;
+
+template <> struct FixedLayout<IP::PROTO> {
+	static constexpr size_t WORDS = 5;
+	static constexpr size_t FIELDS = 13;
+	static constexpr RawField fields[FIELDS] = {
+		{ IP::FieldVersion,				0, 1, 0xf0000000 },
+		{ IP::FieldHeaderLength,		0, 1, 0x0f000000 },
+		{ IP::FieldDiffServicesCP,		0, 1, 0x00fc0000 },
+		{ IP::FieldExpCongestionNot,	0, 1, 0x00030000 },
+		{ IP::FieldTotalLength,			0, 1, 0x0000ffff },
+		{ IP::FieldIdentification,		1, 1, 0xffff0000 },
+		{ IP::FieldFlags,				1, 1, 0x0000e000 },
+		{ IP::FieldFragmentOffset,		1, 1, 0x00001fff },
+		{ IP::FieldTTL,					2, 1, 0xff000000 },
+		{ IP::FieldProtocol,			2, 1, 0x00ff0000 },
+		{ IP::FieldCheckSum,			2, 1, 0x0000ffff },
+		{ IP::FieldSourceIP,			3, 1, 0xffffffff },
+		{ IP::FieldDestinationIP,		4, 1, 0xffffffff },
+	};
+};
+
+template <> struct FixedLayout<IPv6::PROTO> {
+	static constexpr size_t WORDS = 10;
+	static constexpr size_t FIELDS = 8;
+	static constexpr RawField fields[FIELDS] = {
+		{ IPv6::FieldVersion,			0, 1, 0xf0000000 },
+		{ IPv6::FieldTrafficClass,		0, 1, 0x0ff00000 },
+		{ IPv6::FieldFlowLabel,			0, 1, 0x000fffff },
+		{ IPv6::FieldPayloadLength,		1, 1, 0xffff0000 },
+		{ IPv6::FieldNextHeader,		1, 1, 0x0000ff00 },
+		{ IPv6::FieldHopLimit,			1, 1, 0x000000ff },
+		{ IPv6::FieldSourceIP,			2, 4, 0xffffffff },
+		{ IPv6::FieldDestinationIP,		6, 4, 0xffffffff },
+	};
+};
+
+template <> struct FixedLayout<TCP::PROTO> {
+	static constexpr size_t WORDS = 5;
+	static constexpr size_t FIELDS = 10;
+	static constexpr RawField fields[FIELDS] = {
+		{ TCP::FieldSrcPort,			0, 1, 0xffff0000 },
+		{ TCP::FieldDstPort,			0, 1, 0x0000ffff },
+		{ TCP::FieldSeqNumber,			1, 1, 0xffffffff },
+		{ TCP::FieldAckNumber,			2, 1, 0xffffffff },
+		{ TCP::FieldDataOffset,			3, 1, 0xf0000000 },
+		{ TCP::FieldReserved,			3, 1, 0x0f000000 },
+		{ TCP::FieldFlags,				3, 1, 0x00ff0000 },
+		{ TCP::FieldWindowsSize,		3, 1, 0x0000ffff },
+		{ TCP::FieldCheckSum,			4, 1, 0xffff0000 },
+		{ TCP::FieldUrgPointer,			4, 1, 0x0000ffff },
+	};
+};
+
+template <> struct FixedLayout<UDP::PROTO> {
+	static constexpr size_t WORDS = 2;
+	static constexpr size_t FIELDS = 4;
+	static constexpr RawField fields[FIELDS] = {
+		{ UDP::FieldSrcPort,			0, 1, 0xffff0000 },
+		{ UDP::FieldDstPort,			0, 1, 0x0000ffff },
+		{ UDP::FieldLength,				1, 1, 0xffff0000 },
+		{ UDP::FieldCheckSum,			1, 1, 0x0000ffff },
+	};
+};
+
+constexpr RawField FixedLayout<IP::PROTO>::fields[];
+constexpr RawField FixedLayout<IPv6::PROTO>::fields[];
+constexpr RawField FixedLayout<TCP::PROTO>::fields[];
+constexpr RawField FixedLayout<UDP::PROTO>::fields[];
+
+static inline uint32_t read32(const byte *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Both loops have constant bounds and are unrolled, leaving a sequence of
+ * loads, xors and masks without any branch */
+template <int Proto>
+static uint32_t DiffFields(const byte *a, const byte *b)
+{
+	typedef FixedLayout<Proto> L;
+	uint32_t x[L::WORDS], diff = 0;
+
+	for (size_t i = 0; i < L::WORDS; ++i)
+		x[i] = read32(a + 4 * i) ^ read32(b + 4 * i);
+	for (size_t i = 0; i < L::FIELDS; ++i) {
+		const RawField &f = L::fields[i];
+		uint32_t d = 0;
+
+		for (size_t w = 0; w < f.words; ++w)
+			d |= x[f.word + w];
+		diff |= (uint32_t)((d & f.mask) != 0) << f.id;
+	}
+	return diff;
+}
+
+template <int Proto>
+static bool Diff(const Layer *l, const byte *a, const byte *b,
+		uint32_t *fields)
+{
+	typedef FixedLayout<Proto> L;
+
+	/* Do not trust the layout if libcrafter defines the header otherwise */
+	if (l->GetFieldsSize() != L::FIELDS ||
+			l->GetSize() - l->GetPayload().GetSize() != L::WORDS * 4)
+		return false;
+	*fields = DiffFields<Proto>(a, b);
+	return true;
+}
+
+bool DiffFixedHeader(const Layer *l, const byte *a, const byte *b,
+		uint32_t *fields)
+{
+	switch (l->GetID()) {
+	case IP::PROTO:
+		return Diff<IP::PROTO>(l, a, b, fields);
+	case IPv6::PROTO:
+		return Diff<IPv6::PROTO>(l, a, b, fields);
+	case TCP::PROTO:
+		return Diff<TCP::PROTO>(l, a, b, fields);
+	case UDP::PROTO:
+		return Diff<UDP::PROTO>(l, a, b, fields);
+	}
+	return false;
+}
@@ -0,0 +1,24 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __HEADERDIFF_H__
+#define __HEADERDIFF_H__
+
+#include "crafter.h"
+
+using namespace Crafter;
+
+/* Compare two raw IPv4, IPv6, TCP or UDP headers having the layout of layer
+ * l, without going through the fields of libcrafter. On success, bit i of
+ * fields is set if field i of l differs between a and b. Returns false if
+ * the layer has no specialized layout, in which case the fields have to be
+ * compared one by one.
+ */
+bool DiffFixedHeader(const Layer *l, const byte *a, const byte *b,
+		uint32_t *fields);
+
+#endif
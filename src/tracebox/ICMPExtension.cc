@@ -0,0 +1,269 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include <arpa/inet.h>
+
+#include "config.h"
+#ifdef HAVE_LIBJSON
+#include <json/json.h>
+#endif
+#ifdef HAVE_JSONC
+#include <json-c/json.h>
+#endif
+
+#include "ICMPExtension.h"
+
+using namespace std;
+
+#define ICMP_EXT_VERSION		2
+#define ICMP_EXT_HDR_LEN		4
+#define ICMP_EXT_OBJ_HDR_LEN	4
+
+/* Flags of the C-Type of interface information objects (RFC 5837) */
+#define IFINFO_IFINDEX	0x08
+#define IFINFO_IPADDR	0x04
+#define IFINFO_NAME		0x02
+#define IFINFO_MTU		0x01
+
+#define AFI_IPV4	1
+#define AFI_IPV6	2
+
+static uint32_t read32(const byte *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+ICMPExtensions::ICMPExtensions(const QuoteView &quote) : count(0)
+{
+	size_t len;
+	const byte *ext = quote.GetExtensions(&len);
+
+	Parse(ext, len);
+}
+
+ICMPExtensions::ICMPExtensions(const byte *ext, size_t len) : count(0)
+{
+	Parse(ext, len);
+}
+
+void ICMPExtensions::Parse(const byte *ext, size_t len)
+{
+	size_t off = ICMP_EXT_HDR_LEN;
+
+	if (!ext || len < ICMP_EXT_HDR_LEN || (ext[0] >> 4) != ICMP_EXT_VERSION)
+		return;
+
+	while (off + ICMP_EXT_OBJ_HDR_LEN <= len && count < MAX_ICMP_EXT_OBJECTS) {
+		size_t obj_len = (ext[off] << 8) | ext[off + 1];
+		ICMPExtensionObject *o = &objects[count];
+
+		/* Malformed object */
+		if (obj_len < ICMP_EXT_OBJ_HDR_LEN || off + obj_len > len)
+			break;
+		o->class_num = ext[off + 2];
+		o->c_type = ext[off + 3];
+		o->data = ext + off + ICMP_EXT_OBJ_HDR_LEN;
+		o->len = obj_len - ICMP_EXT_OBJ_HDR_LEN;
+		off += obj_len;
+		++count;
+	}
+}
+
+size_t ICMPExtensions::GetMPLSLabels(const ICMPExtensionObject &o,
+		MPLSLabel *labels)
+{
+	size_t n = 0;
+
+	if (o.class_num != ICMP_EXT_CLASS_MPLS || o.c_type != 1)
+		return 0;
+	for (size_t off = 0; off + 4 <= o.len && n < MAX_MPLS_LABELS; off += 4) {
+		uint32_t entry = read32(o.data + off);
+
+		labels[n].label = entry >> 12;
+		labels[n].tc = (entry >> 9) & 0x07;
+		labels[n].s = (entry >> 8) & 0x01;
+		labels[n].ttl = entry & 0xff;
+		++n;
+	}
+	return n;
+}
+
+bool ICMPExtensions::GetInterfaceInfo(const ICMPExtensionObject &o,
+		InterfaceInfo *info)
+{
+	size_t off = 0;
+
+	if (o.class_num != ICMP_EXT_CLASS_INTERFACE)
+		return false;
+
+	memset(info, 0, sizeof(*info));
+	info->role = (InterfaceInfo::Role)(o.c_type >> 6);
+	/* Sub-objects always come in this order */
+	if (o.c_type & IFINFO_IFINDEX) {
+		if (off + 4 > o.len)
+			return false;
+		info->has_ifindex = true;
+		info->ifindex = read32(o.data + off);
+		off += 4;
+	}
+	if (o.c_type & IFINFO_IPADDR) {
+		size_t addr_len;
+
+		if (off + 4 > o.len)
+			return false;
+		info->afi = (o.data[off] << 8) | o.data[off + 1];
+		addr_len = info->afi == AFI_IPV4 ? 4 : 16;
+		if (off + 4 + addr_len > o.len)
+			return false;
+		info->addr = o.data + off + 4;
+		off += 4 + addr_len;
+	}
+	if (o.c_type & IFINFO_NAME) {
+		/* The length includes the length octet itself */
+		if (off >= o.len || !o.data[off] || off + o.data[off] > o.len)
+			return false;
+		info->name = (const char *)o.data + off + 1;
+		info->name_len = o.data[off] - 1;
+		/* Strip the padding */
+		while (info->name_len && !info->name[info->name_len - 1])
+			--info->name_len;
+		off += o.data[off];
+	}
+	if (o.c_type & IFINFO_MTU) {
+		if (off + 4 > o.len)
+			return false;
+		info->has_mtu = true;
+		info->mtu = read32(o.data + off);
+	}
+	return true;
+}
+
+std::string ICMPExtensions::GetName(const ICMPExtensionObject &o)
+{
+	switch (o.class_num) {
+	case ICMP_EXT_CLASS_MPLS:
+		return "MPLS";
+	case ICMP_EXT_CLASS_INTERFACE:
+		return "Interface";
+	}
+	return "Class" + std::to_string(o.class_num);
+}
+
+std::string ICMPExtensions::GetAddress(const InterfaceInfo &info)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (!info.addr || (info.afi != AFI_IPV4 && info.afi != AFI_IPV6))
+		return "";
+	if (!inet_ntop(info.afi == AFI_IPV4 ? AF_INET : AF_INET6, info.addr,
+				buf, sizeof(buf)))
+		return "";
+	return buf;
+}
+
+const char *ICMPExtensions::GetRoleName(InterfaceInfo::Role role)
+{
+	static const char *roles[] = {
+		"incoming", "sub-ip", "outgoing", "next-hop",
+	};
+
+	return roles[role & 0x03];
+}
+
+void ICMPExtensions::Print(std::ostream& out, bool verbose) const
+{
+	for (const ICMPExtensionObject *o = begin(); o != end(); ++o) {
+		MPLSLabel labels[MAX_MPLS_LABELS];
+		InterfaceInfo info;
+		size_t n;
+
+		out << GetName(*o);
+		if (!verbose) {
+			out << " ";
+			continue;
+		}
+		out << "(";
+		if ((n = GetMPLSLabels(*o, labels))) {
+			for (size_t i = 0; i < n; ++i)
+				out << (i ? " " : "") << "label=" << labels[i].label <<
+					",tc=" << (int)labels[i].tc << ",s=" << labels[i].s <<
+					",ttl=" << (int)labels[i].ttl;
+		} else if (GetInterfaceInfo(*o, &info)) {
+			out << "role=" << GetRoleName(info.role);
+			if (info.has_ifindex)
+				out << ",ifindex=" << info.ifindex;
+			if (info.addr)
+				out << ",addr=" << GetAddress(info);
+			if (info.name)
+				out << ",name=" << std::string(info.name, info.name_len);
+			if (info.has_mtu)
+				out << ",mtu=" << info.mtu;
+		} else {
+			out << "ctype=" << (int)o->c_type << ",len=" << o->len;
+		}
+		out << ") ";
+	}
+}
+
+void ICMPExtensions::Print_JSON(json_object *ext, bool verbose) const
+{
+	for (const ICMPExtensionObject *o = begin(); o != end(); ++o) {
+		MPLSLabel labels[MAX_MPLS_LABELS];
+		InterfaceInfo info;
+		json_object *descr;
+		size_t n;
+
+		if (!verbose) {
+			json_object_array_add(ext,
+					json_object_new_string(GetName(*o).c_str()));
+			continue;
+		}
+
+		if ((n = GetMPLSLabels(*o, labels))) {
+			descr = json_object_new_array();
+			for (size_t i = 0; i < n; ++i) {
+				json_object *entry = json_object_new_object();
+				json_object_object_add(entry, "label",
+						json_object_new_int(labels[i].label));
+				json_object_object_add(entry, "tc",
+						json_object_new_int(labels[i].tc));
+				json_object_object_add(entry, "s",
+						json_object_new_boolean(labels[i].s));
+				json_object_object_add(entry, "ttl",
+						json_object_new_int(labels[i].ttl));
+				json_object_array_add(descr, entry);
+			}
+		} else if (GetInterfaceInfo(*o, &info)) {
+			descr = json_object_new_object();
+			json_object_object_add(descr, "role",
+					json_object_new_string(GetRoleName(info.role)));
+			if (info.has_ifindex)
+				json_object_object_add(descr, "ifindex",
+						json_object_new_int64(info.ifindex));
+			if (info.addr)
+				json_object_object_add(descr, "addr",
+						json_object_new_string(GetAddress(info).c_str()));
+			if (info.name)
+				json_object_object_add(descr, "name",
+						json_object_new_string(std::string(info.name,
+								info.name_len).c_str()));
+			if (info.has_mtu)
+				json_object_object_add(descr, "mtu",
+						json_object_new_int64(info.mtu));
+		} else {
+			descr = json_object_new_object();
+			json_object_object_add(descr, "ctype",
+					json_object_new_int(o->c_type));
+			json_object_object_add(descr, "len",
+					json_object_new_int(o->len));
+		}
+
+		json_object *descr_hdr = json_object_new_object();
+		json_object_object_add(descr_hdr, GetName(*o).c_str(), descr);
+		json_object_array_add(ext, descr_hdr);
+	}
+}
@@ -0,0 +1,123 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __ICMPEXTENSION_H__
+#define __ICMPEXTENSION_H__
+
+#include "crafter.h"
+
+#include "QuoteView.h"
+
+struct json_object;
+
+using namespace Crafter;
+
+/* Object classes of ICMP extensions */
+#define ICMP_EXT_CLASS_MPLS			1	/* RFC 4950 */
+#define ICMP_EXT_CLASS_INTERFACE	2	/* RFC 5837 */
+
+/* An ICMP extension structure (RFC 4884) cannot hold more objects than this
+ * in a reply that fits in a minimal MTU */
+#define MAX_ICMP_EXT_OBJECTS 16
+
+/* An MPLS label stack can be longer, but only the top of it is decoded */
+#define MAX_MPLS_LABELS 8
+
+/* An object of an ICMP extension structure, pointing to the reply */
+struct ICMPExtensionObject {
+	byte class_num;
+	byte c_type;
+	/* Payload of the object */
+	const byte *data;
+	uint16_t len;
+};
+
+/* An entry of an MPLS label stack object */
+struct MPLSLabel {
+	uint32_t label;
+	/* Traffic class, formerly known as EXP */
+	uint8_t tc;
+	/* Bottom of stack */
+	bool s;
+	uint8_t ttl;
+};
+
+/* An interface information object */
+struct InterfaceInfo {
+	enum Role {
+		INCOMING,
+		SUB_IP,
+		OUTGOING,
+		NEXT_HOP,
+	};
+
+	Role role;
+	/* The fields below are only set if the object holds them */
+	bool has_ifindex;
+	uint32_t ifindex;
+	/* Address family (1 for IPv4, 2 for IPv6), 0 if there is no address */
+	uint16_t afi;
+	const byte *addr;
+	/* Not NUL-terminated */
+	const char *name;
+	uint8_t name_len;
+	bool has_mtu;
+	uint32_t mtu;
+};
+
+/* The objects of the extension structure appended to an ICMP error. Objects
+ * are decoded directly from the reply, which must outlive them, and are
+ * only turned into typed records on demand.
+ */
+class ICMPExtensions {
+	ICMPExtensionObject objects[MAX_ICMP_EXT_OBJECTS];
+	size_t count;
+
+	void Parse(const byte *ext, size_t len);
+
+public:
+	ICMPExtensions() : count(0) {}
+	explicit ICMPExtensions(const QuoteView &quote);
+	/* Decode an extension structure of len bytes, starting at its header */
+	ICMPExtensions(const byte *ext, size_t len);
+
+	const ICMPExtensionObject *begin() const {
+		return objects;
+	}
+
+	const ICMPExtensionObject *end() const {
+		return objects + count;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	/* Decode the label stack of an MPLS object. Returns the number of
+	 * labels stored in labels, which must hold MAX_MPLS_LABELS elements. */
+	static size_t GetMPLSLabels(const ICMPExtensionObject &o,
+			MPLSLabel *labels);
+
+	/* Decode an interface information object */
+	static bool GetInterfaceInfo(const ICMPExtensionObject &o,
+			InterfaceInfo *info);
+
+	/* e.g. MPLS, Interface or Class<n> */
+	static std::string GetName(const ICMPExtensionObject &o);
+
+	/* Printable address of an interface, empty if it has none */
+	static std::string GetAddress(const InterfaceInfo &info);
+
+	static const char *GetRoleName(InterfaceInfo::Role role);
+
+	void Print(std::ostream& out, bool verbose = false) const;
+
+	/* Add one entry per object to the JSON array ext */
+	void Print_JSON(json_object *ext, bool verbose = false) const;
+};
+
+#endif
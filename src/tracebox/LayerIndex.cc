@@ -0,0 +1,49 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include "config.h"
+#include "LayerIndex.h"
+
+LayerIndex::LayerIndex(const Packet *pkt) : count(0), complete(true)
+{
+	size_t off = 0, pos = 0;
+
+	for (Layer *l : *pkt) {
+		size_t i;
+
+		if (count == MAX_INDEXED_LAYERS) {
+			complete = false;
+			break;
+		}
+		/* Layers are mostly appended in order, keep the insertion short */
+		for (i = count; i > 0 && entries[i - 1].proto > l->GetID(); --i)
+			entries[i] = entries[i - 1];
+		entries[i].proto = l->GetID();
+		entries[i].pos = pos++;
+		entries[i].option = dynamic_cast<const TCPOptionLayer *>(l) ||
+			dynamic_cast<const IPOptionLayer *>(l);
+		entries[i].offset = off;
+		entries[i].layer = l;
+		off += l->GetSize();
+		++count;
+	}
+}
+
+const LayerIndex::Entry *LayerIndex::Find(int proto) const
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (entries[mid].proto < proto)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < count && entries[lo].proto == proto ? &entries[lo] : end();
+}
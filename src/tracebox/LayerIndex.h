@@ -0,0 +1,72 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __LAYERINDEX_H__
+#define __LAYERINDEX_H__
+
+#include "crafter.h"
+
+using namespace Crafter;
+
+/* A packet cannot hold more layers than this without being made of empty
+ * or single-byte ones, e.g. 40 NOPs in each of the IPv4 and TCP options */
+#define MAX_INDEXED_LAYERS 128
+
+/* Maps the protocol ID of the layers of a packet to their position and
+ * offset, so that finding the layers of a given protocol never scans the
+ * packet. The index is built in a single pass without allocating and must
+ * be rebuilt whenever layers are added to or removed from the packet.
+ */
+class LayerIndex {
+public:
+	struct Entry {
+		int proto;
+		/* Position of the layer in the packet */
+		uint8_t pos;
+		/* Whether the layer is a TCP or IPv4 option */
+		bool option;
+		/* Offset of the layer in the raw packet (in bytes) */
+		uint16_t offset;
+		const Layer *layer;
+	};
+
+	explicit LayerIndex(const Packet *pkt);
+
+	/* Entries ordered by protocol ID, then by position */
+	const Entry *begin() const {
+		return entries;
+	}
+
+	const Entry *end() const {
+		return entries + count;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	/* Whether every layer of the packet fits in the index */
+	bool IsComplete() const {
+		return complete;
+	}
+
+	/* First entry of the given protocol, or end() */
+	const Entry *Find(int proto) const;
+
+	/* First layer of the given protocol, NULL if there is none */
+	Layer *Get(int proto) const {
+		const Entry *e = Find(proto);
+		return e != end() ? const_cast<Layer *>(e->layer) : NULL;
+	}
+
+private:
+	Entry entries[MAX_INDEXED_LAYERS];
+	size_t count;
+	bool complete;
+};
+
+#endif
@@ -0,0 +1,537 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "NFTables.h"
+
+#ifdef HAVE_NFTABLES
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/table.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/rule.h>
+#include <libnftnl/expr.h>
+#include <libnftnl/set.h>
+#endif
+
+static int parse_proto(const std::string &s)
+{
+	char *end;
+	long n;
+
+	if (s == "tcp")
+		return IPPROTO_TCP;
+	if (s == "udp")
+		return IPPROTO_UDP;
+	if (s == "icmp")
+		return IPPROTO_ICMP;
+	if (s == "icmpv6" || s == "ipv6-icmp")
+		return IPPROTO_ICMPV6;
+	n = strtol(s.c_str(), &end, 10);
+	return s.empty() || *end || n < 0 || n > 255 ? -1 : n;
+}
+
+static int parse_port(const std::string &s, int proto)
+{
+	struct servent *se;
+	char *end;
+	long n;
+
+	n = strtol(s.c_str(), &end, 10);
+	if (!s.empty() && !*end)
+		return n < 0 || n > 0xffff ? -1 : n;
+	/* Service names, but no ranges */
+	se = getservbyname(s.c_str(), proto == IPPROTO_TCP ? "tcp" : "udp");
+	return se ? ntohs(se->s_port) : -1;
+}
+
+bool NFTRules::ParseMatch(const std::vector<std::string> &args, NFTMatch *m)
+{
+	*m = NFTMatch();
+	for (size_t i = 0; i + 1 < args.size(); i += 2) {
+		const std::string &opt = args[i], &val = args[i + 1];
+
+		if (opt == "-p" || opt == "--protocol") {
+			if (val != "all" && (m->proto = parse_proto(val)) < 0)
+				return false;
+		} else if (opt == "-m" || opt == "--match") {
+			/* Only the matches implied by the protocol */
+			if (val != "tcp" && val != "udp")
+				return false;
+		} else if (opt == "--sport" || opt == "--source-port") {
+			if ((m->sport = parse_port(val, m->proto)) < 0)
+				return false;
+		} else if (opt == "--dport" || opt == "--destination-port") {
+			if ((m->dport = parse_port(val, m->proto)) < 0)
+				return false;
+		} else {
+			return false;
+		}
+	}
+	if (args.size() % 2)
+		return false;
+	/* iptables rejects ports without a protocol that has them */
+	return (m->sport < 0 && m->dport < 0) ||
+		m->proto == IPPROTO_TCP || m->proto == IPPROTO_UDP;
+}
+
+static uint64_t filter_id(int proto, uint16_t sport, uint16_t dport)
+{
+	return ((uint64_t)proto << 32) | ((uint64_t)sport << 16) | dport;
+}
+
+bool NFTRules::AddFilter(int proto, uint16_t sport, uint16_t dport)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	unsigned &n = filters[filter_id(proto, sport, dport)];
+
+	if (n++)
+		return true;
+	if (Filter(true, proto, sport, dport))
+		return true;
+	filters.erase(filter_id(proto, sport, dport));
+	return false;
+}
+
+bool NFTRules::RemoveFilter(int proto, uint16_t sport, uint16_t dport)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::map<uint64_t, unsigned>::iterator it =
+		filters.find(filter_id(proto, sport, dport));
+
+	if (it == filters.end())
+		return false;
+	if (--it->second)
+		return true;
+	filters.erase(it);
+	return Filter(false, proto, sport, dport);
+}
+
+#ifdef HAVE_NFTABLES
+
+#define NFT_FILTER_CHAIN	"input"
+#define NFT_FILTER_SET		"filters"
+/* Identifies the set to the rules of the batch creating it */
+#define NFT_FILTER_SET_ID	1
+
+/* Each part of a concatenation takes whole 32-bit registers */
+#define NFT_FILTER_KEY_LEN	12
+/* nft data types of inet_proto . inet_service . inet_service, 6 bits each.
+ * The kernel ignores them, they only let nft list the set. */
+#define NFT_TYPE_INET_PROTOCOL	12
+#define NFT_TYPE_INET_SERVICE	13
+#define NFT_FILTER_KEY_TYPE \
+	((((NFT_TYPE_INET_PROTOCOL << 6) | NFT_TYPE_INET_SERVICE) << 6) | \
+	 NFT_TYPE_INET_SERVICE)
+
+/* Enough for the few messages of the largest batch, creating the table.
+ * MNL_SOCKET_BUFFER_SIZE depends on the page size at runtime, the buffers
+ * use its upper bound instead. */
+#define NFT_BATCH_LEN		16384
+/* Enough for any message sent by the kernel */
+#define NFT_RECV_LEN		8192
+
+/* Time to wait for the acks of a batch */
+#define NFT_ACK_TIMEOUT_S	1
+
+/* The messages of a transaction, each of them acked by the kernel */
+class NFTBatch {
+	char buf[NFT_BATCH_LEN];
+	struct mnl_nlmsg_batch *b;
+	uint32_t &seq;
+
+public:
+	/* Sequence number of the batch begin message */
+	uint32_t first;
+	size_t count;
+
+	explicit NFTBatch(uint32_t &seq) : seq(seq), first(seq), count(0)
+	{
+		b = mnl_nlmsg_batch_start(buf, sizeof(buf));
+		nftnl_batch_begin((char *)mnl_nlmsg_batch_current(b), seq++);
+		mnl_nlmsg_batch_next(b);
+	}
+
+	~NFTBatch()
+	{
+		mnl_nlmsg_batch_stop(b);
+	}
+
+	/* Header of the next message, whose payload must be built before
+	 * calling add() again */
+	struct nlmsghdr *add(uint16_t type, uint16_t flags)
+	{
+		struct nlmsghdr *nlh;
+
+		if (count)
+			mnl_nlmsg_batch_next(b);
+		nlh = nftnl_nlmsg_build_hdr((char *)mnl_nlmsg_batch_current(b),
+				type, NFPROTO_INET, flags | NLM_F_ACK, seq++);
+		++count;
+		return nlh;
+	}
+
+	void end()
+	{
+		if (count)
+			mnl_nlmsg_batch_next(b);
+		nftnl_batch_end((char *)mnl_nlmsg_batch_current(b), seq++);
+		mnl_nlmsg_batch_next(b);
+	}
+
+	const void *head()
+	{
+		return mnl_nlmsg_batch_head(b);
+	}
+
+	size_t size()
+	{
+		return mnl_nlmsg_batch_size(b);
+	}
+};
+
+static void add_chain(NFTBatch &b, const std::string &table,
+		const std::string &name)
+{
+	struct nftnl_chain *c = nftnl_chain_alloc();
+
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table.c_str());
+	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, name.c_str());
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, "filter");
+	nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, NF_INET_LOCAL_IN);
+	/* Same priority as the filter table of iptables */
+	nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, 0);
+	nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, NF_ACCEPT);
+	nftnl_chain_nlmsg_build_payload(b.add(NFT_MSG_NEWCHAIN, NLM_F_CREATE), c);
+	nftnl_chain_free(c);
+}
+
+static struct nftnl_rule *new_rule(const std::string &table,
+		const std::string &chain)
+{
+	struct nftnl_rule *r = nftnl_rule_alloc();
+
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table.c_str());
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain.c_str());
+	nftnl_rule_set_u32(r, NFTNL_RULE_FAMILY, NFPROTO_INET);
+	return r;
+}
+
+static void add_rule(NFTBatch &b, struct nftnl_rule *r)
+{
+	nftnl_rule_nlmsg_build_payload(b.add(NFT_MSG_NEWRULE,
+				NLM_F_CREATE | NLM_F_APPEND), r);
+	nftnl_rule_free(r);
+}
+
+static void add_meta(struct nftnl_rule *r, uint32_t key, uint32_t dreg)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("meta");
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_META_KEY, key);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_META_DREG, dreg);
+	nftnl_rule_add_expr(r, e);
+}
+
+/* Load len bytes at off in the transport header */
+static void add_payload(struct nftnl_rule *r, uint32_t off, uint32_t len,
+		uint32_t dreg)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("payload");
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_BASE,
+			NFT_PAYLOAD_TRANSPORT_HEADER);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET, off);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_LEN, len);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, dreg);
+	nftnl_rule_add_expr(r, e);
+}
+
+static void add_cmp(struct nftnl_rule *r, uint32_t sreg, const void *data,
+		uint32_t len)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("cmp");
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, sreg);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+	nftnl_expr_set(e, NFTNL_EXPR_CMP_DATA, data, len);
+	nftnl_rule_add_expr(r, e);
+}
+
+static void add_lookup(struct nftnl_rule *r, uint32_t sreg, const char *set,
+		uint32_t set_id)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("lookup");
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SREG, sreg);
+	nftnl_expr_set_str(e, NFTNL_EXPR_LOOKUP_SET, set);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SET_ID, set_id);
+	nftnl_rule_add_expr(r, e);
+}
+
+static void add_verdict(struct nftnl_rule *r, uint32_t verdict)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("immediate");
+
+	nftnl_expr_set_u32(e, NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_IMM_VERDICT, verdict);
+	nftnl_rule_add_expr(r, e);
+}
+
+static void add_queue(struct nftnl_rule *r, uint16_t num, uint16_t total)
+{
+	struct nftnl_expr *e = nftnl_expr_alloc("queue");
+
+	nftnl_expr_set_u16(e, NFTNL_EXPR_QUEUE_NUM, num);
+	nftnl_expr_set_u16(e, NFTNL_EXPR_QUEUE_TOTAL, total);
+	nftnl_rule_add_expr(r, e);
+}
+
+NFTRules::NFTRules() : nl(NULL), table("tracebox" + std::to_string(getpid())),
+	seq(time(NULL))
+{
+}
+
+NFTRules::~NFTRules()
+{
+	if (!nl)
+		return;
+
+	/* Takes the chains, rules and set along */
+	NFTBatch b(seq);
+	struct nftnl_table *t = nftnl_table_alloc();
+
+	nftnl_table_set_str(t, NFTNL_TABLE_NAME, table.c_str());
+	nftnl_table_nlmsg_build_payload(b.add(NFT_MSG_DELTABLE, 0), t);
+	nftnl_table_free(t);
+	Commit(b);
+	mnl_socket_close(nl);
+}
+
+bool NFTRules::Init()
+{
+	struct timeval tv = { NFT_ACK_TIMEOUT_S, 0 };
+
+	if (!(nl = mnl_socket_open(NETLINK_NETFILTER)))
+		return false;
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0 ||
+			setsockopt(mnl_socket_get_fd(nl), SOL_SOCKET, SO_RCVTIMEO,
+				&tv, sizeof(tv)) < 0)
+		goto fail;
+
+	{
+		NFTBatch b(seq);
+		struct nftnl_table *t = nftnl_table_alloc();
+		struct nftnl_set *s = nftnl_set_alloc();
+		struct nftnl_rule *r;
+
+		nftnl_table_set_str(t, NFTNL_TABLE_NAME, table.c_str());
+		nftnl_table_nlmsg_build_payload(b.add(NFT_MSG_NEWTABLE,
+					NLM_F_CREATE), t);
+		nftnl_table_free(t);
+
+		add_chain(b, table, NFT_FILTER_CHAIN);
+
+		nftnl_set_set_str(s, NFTNL_SET_TABLE, table.c_str());
+		nftnl_set_set_str(s, NFTNL_SET_NAME, NFT_FILTER_SET);
+		nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_INET);
+		nftnl_set_set_u32(s, NFTNL_SET_ID, NFT_FILTER_SET_ID);
+		nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, NFT_FILTER_KEY_TYPE);
+		nftnl_set_set_u32(s, NFTNL_SET_KEY_LEN, NFT_FILTER_KEY_LEN);
+		nftnl_set_nlmsg_build_payload(b.add(NFT_MSG_NEWSET,
+					NLM_F_CREATE), s);
+		nftnl_set_free(s);
+
+		/* meta l4proto . th sport . th dport @filters drop */
+		r = new_rule(table, NFT_FILTER_CHAIN);
+		add_meta(r, NFT_META_L4PROTO, NFT_REG32_00);
+		add_payload(r, 0, 2, NFT_REG32_01);
+		add_payload(r, 2, 2, NFT_REG32_02);
+		add_lookup(r, NFT_REG32_00, NFT_FILTER_SET, NFT_FILTER_SET_ID);
+		add_verdict(r, NF_DROP);
+		add_rule(b, r);
+
+		if (Commit(b))
+			return true;
+	}
+fail:
+	mnl_socket_close(nl);
+	nl = NULL;
+	return false;
+}
+
+bool NFTRules::Commit(NFTBatch &b)
+{
+	char buf[NFT_RECV_LEN];
+	size_t acked = 0;
+	ssize_t len;
+	int err = 0;
+
+	b.end();
+	if (mnl_socket_sendto(nl, b.head(), b.size()) < 0)
+		return false;
+	while (!err && acked < b.count &&
+			(len = mnl_socket_recvfrom(nl, buf, sizeof(buf))) > 0) {
+		const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+		int rem = len;
+
+		for (; mnl_nlmsg_ok(nlh, rem); nlh = mnl_nlmsg_next(nlh, &rem)) {
+			const struct nlmsgerr *e;
+
+			/* Left over by a previous batch that failed */
+			if (nlh->nlmsg_seq < b.first || nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			e = (const struct nlmsgerr *)mnl_nlmsg_get_payload(nlh);
+			if (e->error && !err)
+				err = -e->error;
+			++acked;
+		}
+	}
+	if (err)
+		errno = err;
+	return !err && acked == b.count;
+}
+
+NFTRules *NFTRules::Get()
+{
+	static NFTRules rules;
+	static bool ok = rules.Init();
+
+	return ok ? &rules : NULL;
+}
+
+bool NFTRules::Filter(bool add, int proto, uint16_t sport, uint16_t dport)
+{
+	unsigned char key[NFT_FILTER_KEY_LEN];
+	uint16_t port;
+
+	if (!nl)
+		return false;
+
+	memset(key, 0, sizeof(key));
+	key[0] = proto;
+	port = htons(sport);
+	memcpy(key + 4, &port, sizeof(port));
+	port = htons(dport);
+	memcpy(key + 8, &port, sizeof(port));
+
+	NFTBatch b(seq);
+	struct nftnl_set *s = nftnl_set_alloc();
+	struct nftnl_set_elem *e = nftnl_set_elem_alloc();
+
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, table.c_str());
+	nftnl_set_set_str(s, NFTNL_SET_NAME, NFT_FILTER_SET);
+	nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, key, sizeof(key));
+	nftnl_set_elem_add(s, e);
+	nftnl_set_elems_nlmsg_build_payload(add ?
+			b.add(NFT_MSG_NEWSETELEM, NLM_F_CREATE) :
+			b.add(NFT_MSG_DELSETELEM, 0), s);
+	nftnl_set_free(s);
+	return Commit(b);
+}
+
+bool NFTRules::AddQueue(const NFTMatch &m, int queue, int n)
+{
+	std::string chain = "queue" + std::to_string(queue);
+	std::lock_guard<std::mutex> guard(lock);
+	struct nftnl_rule *r;
+
+	if (!nl)
+		return false;
+
+	NFTBatch b(seq);
+
+	add_chain(b, table, chain);
+	r = new_rule(table, chain);
+	if (m.proto >= 0) {
+		uint8_t proto = m.proto;
+
+		add_meta(r, NFT_META_L4PROTO, NFT_REG_1);
+		add_cmp(r, NFT_REG_1, &proto, sizeof(proto));
+	}
+	if (m.sport >= 0) {
+		uint16_t port = htons(m.sport);
+
+		add_payload(r, 0, 2, NFT_REG_1);
+		add_cmp(r, NFT_REG_1, &port, sizeof(port));
+	}
+	if (m.dport >= 0) {
+		uint16_t port = htons(m.dport);
+
+		add_payload(r, 2, 2, NFT_REG_1);
+		add_cmp(r, NFT_REG_1, &port, sizeof(port));
+	}
+	add_queue(r, queue, n);
+	add_rule(b, r);
+	return Commit(b);
+}
+
+bool NFTRules::RemoveQueue(int queue)
+{
+	std::string chain = "queue" + std::to_string(queue);
+	std::lock_guard<std::mutex> guard(lock);
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+
+	if (!nl)
+		return false;
+
+	NFTBatch b(seq);
+
+	/* Without a handle, the rules of the whole chain are deleted */
+	r = new_rule(table, chain);
+	nftnl_rule_nlmsg_build_payload(b.add(NFT_MSG_DELRULE, 0), r);
+	nftnl_rule_free(r);
+
+	c = nftnl_chain_alloc();
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table.c_str());
+	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, chain.c_str());
+	nftnl_chain_nlmsg_build_payload(b.add(NFT_MSG_DELCHAIN, 0), c);
+	nftnl_chain_free(c);
+	return Commit(b);
+}
+
+#else
+
+NFTRules::NFTRules() : nl(NULL), seq(0) {}
+
+NFTRules::~NFTRules() {}
+
+NFTRules *NFTRules::Get()
+{
+	return NULL;
+}
+
+bool NFTRules::Filter(bool, int, uint16_t, uint16_t)
+{
+	return false;
+}
+
+bool NFTRules::AddQueue(const NFTMatch &, int, int)
+{
+	return false;
+}
+
+bool NFTRules::RemoveQueue(int)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __NFTABLES_H__
+#define __NFTABLES_H__
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct mnl_socket;
+class NFTBatch;
+
+/* The packets sent to a sniffer, a field is ignored when negative */
+struct NFTMatch {
+	int proto;
+	int sport;
+	int dport;
+
+	NFTMatch() : proto(-1), sport(-1), dport(-1) {}
+};
+
+/* Firewall rules installed over netlink in an nftables table of this
+ * process, instead of running iptables for each of them. The table holds a
+ * set of (protocol, source port, destination port) triples dropped on input,
+ * so that filtering a port pair is a single element insertion, and a chain
+ * per sniffer queueing its packets. Each change is one atomic batch, and
+ * the whole table goes away with the process.
+ */
+class NFTRules {
+	std::mutex lock;
+	struct mnl_socket *nl;
+	std::string table;
+	uint32_t seq;
+	/* Number of filters of each triple, as a set holds it only once */
+	std::map<uint64_t, unsigned> filters;
+
+	NFTRules();
+	NFTRules(const NFTRules&) = delete;
+	NFTRules& operator=(const NFTRules&) = delete;
+
+	bool Init();
+	bool Filter(bool add, int proto, uint16_t sport, uint16_t dport);
+	/* Send a batch and wait until the kernel acks all its messages */
+	bool Commit(NFTBatch &b);
+
+public:
+	~NFTRules();
+
+	/* The rules of this process, NULL if nftables cannot be used, e.g. if
+	 * tracebox was built without it or the kernel lacks nf_tables */
+	static NFTRules *Get();
+
+	/* Drop the incoming packets of proto (IPPROTO_TCP or IPPROTO_UDP)
+	 * from sport to dport */
+	bool AddFilter(int proto, uint16_t sport, uint16_t dport);
+	bool RemoveFilter(int proto, uint16_t sport, uint16_t dport);
+
+	/* Translate iptables match arguments, e.g. -p tcp --dport 80. Returns
+	 * false if they use anything else, which is then left to iptables. */
+	static bool ParseMatch(const std::vector<std::string> &args,
+			NFTMatch *m);
+
+	/* Queue the incoming packets matching m to the queues
+	 * [queue, queue + n), spreading flows as --queue-balance does */
+	bool AddQueue(const NFTMatch &m, int queue, int n);
+	bool RemoveQueue(int queue);
+};
+
+#endif
@@ -0,0 +1,339 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include <iomanip>
+
+#include "config.h"
+#ifdef HAVE_LIBJSON
+#include <json/json.h>
+#endif
+#ifdef HAVE_JSONC
+#include <json-c/json.h>
+#endif
+
+#include "OptionModification.h"
+
+using namespace std;
+
+#define TCPOPT_EOL		0
+#define TCPOPT_NOP		1
+#define TCPOPT_MSS		2
+#define TCPOPT_WSCALE	3
+#define TCPOPT_SACKP	4
+#define TCPOPT_SACK		5
+#define TCPOPT_TS		8
+#define TCPOPT_MPTCP	30
+#define TCPOPT_EXP1		253
+#define TCPOPT_EXP2		254
+
+#define IPOPT_EOL		0
+#define IPOPT_NOP		1
+
+/* ExID of TFO when sent as an experimental option (RFC 7413) */
+#define TFO_EXID		0xF989
+
+/* The TFO and EDO kinds are the ones used by libcrafter */
+static byte tfo_kind()
+{
+	static const byte kind = TCPOptionFastOpen().GetKind();
+	return kind;
+}
+
+static byte edo_kind()
+{
+	static const byte kind = TCPOptionEDO().GetKind();
+	return kind;
+}
+
+size_t ParseRawOptions(int proto, const byte *area, size_t len,
+		RawOption *opts)
+{
+	size_t count = 0;
+	size_t i = 0;
+	/* EOL and NOP share the same values for both TCP and IP */
+	const byte eol = proto == IP::PROTO ? IPOPT_EOL : TCPOPT_EOL;
+	const byte nop = proto == IP::PROTO ? IPOPT_NOP : TCPOPT_NOP;
+
+	while (i < len && count < MAX_RAW_OPTIONS) {
+		RawOption *o = &opts[count];
+		byte kind = area[i];
+
+		if (kind == eol)
+			break;
+		if (kind == nop) {
+			++i;
+			continue;
+		}
+		/* Truncated or malformed option */
+		if (i + 1 >= len || area[i + 1] < 2 || i + area[i + 1] > len)
+			break;
+
+		o->kind = kind;
+		o->subkind = 0;
+		o->offset = i;
+		o->len = area[i + 1];
+		if (proto == TCP::PROTO) {
+			if (kind == TCPOPT_MPTCP && o->len > 2)
+				o->subkind = area[i + 2] >> 4;
+			else if ((kind == TCPOPT_EXP1 || kind == TCPOPT_EXP2) && o->len > 3)
+				o->subkind = (area[i + 2] << 8) | area[i + 3];
+		}
+		i += o->len;
+		++count;
+	}
+	return count;
+}
+
+static const char *mptcp_subtypes[] = {
+	"MPCapable", "MPJoin", "DSS", "AddAddr", "RemoveAddr", "MPPrio",
+	"MPFail", "MPFastclose",
+};
+
+static std::string GetTCPOptionName(const RawOption &opt)
+{
+	switch (opt.kind) {
+	case TCPOPT_MSS:
+		return "MSS";
+	case TCPOPT_WSCALE:
+		return "WScale";
+	case TCPOPT_SACKP:
+		return "SACKP";
+	case TCPOPT_SACK:
+		return "SACK";
+	case TCPOPT_TS:
+		return "TS";
+	case TCPOPT_MPTCP:
+		if (opt.subkind < sizeof(mptcp_subtypes) / sizeof(*mptcp_subtypes))
+			return mptcp_subtypes[opt.subkind];
+		return "MPTCP";
+	case TCPOPT_EXP1:
+	case TCPOPT_EXP2:
+		if (opt.subkind == TFO_EXID)
+			return "TFO";
+		break;
+	}
+	if (opt.kind == tfo_kind())
+		return "TFO";
+	if (opt.kind == edo_kind())
+		return "EDO";
+	return "Kind" + std::to_string(opt.kind);
+}
+
+static std::string GetIPOptionName(const RawOption &opt)
+{
+	switch (opt.kind) {
+	case 7:
+		return "RR";
+	case 68:
+		return "TS";
+	case 82:
+		return "Traceroute";
+	case 130:
+		return "Security";
+	case 131:
+		return "LSRR";
+	case 137:
+		return "SSRR";
+	case 148:
+		return "RouterAlert";
+	}
+	return "Type" + std::to_string(opt.kind);
+}
+
+std::string GetRawOptionName(int proto, const RawOption &opt)
+{
+	if (proto == IP::PROTO)
+		return "IPOption::" + GetIPOptionName(opt);
+	return "TCPOption::" + GetTCPOptionName(opt);
+}
+
+static std::string GetRawOptionValue(int proto, const RawOption &opt,
+		const byte *v)
+{
+	std::ostringstream ss;
+
+	if (proto == TCP::PROTO) {
+		switch (opt.kind) {
+		case TCPOPT_MSS:
+			if (opt.len == 4)
+				return std::to_string((v[2] << 8) | v[3]);
+			break;
+		case TCPOPT_WSCALE:
+			if (opt.len == 3)
+				return std::to_string(v[2]);
+			break;
+		}
+	}
+	ss << std::hex << std::setfill('0');
+	for (size_t i = 2; i < opt.len; ++i)
+		ss << std::setw(2) << (int)v[i];
+	return ss.str();
+}
+
+OptionModification::OptionModification(int proto, Change change,
+		const RawOption &opt, size_t hdr_offset, const byte *v1,
+		const byte *v2, const RawOption *opt2) :
+	Modification(proto, GetRawOptionName(proto, opt),
+			(hdr_offset + opt.offset) * 8, opt.len * 8),
+	change(change), kind(opt.kind)
+{
+	switch (change) {
+	case MODIFIED:
+		field1_repr = GetRawOptionValue(proto, opt, v1);
+		field2_repr = GetRawOptionValue(proto, opt2 ? *opt2 : opt, v2);
+		break;
+	case REORDERED:
+		field1_repr = "@" + std::to_string(opt.offset);
+		field2_repr = "@" + std::to_string(opt2 ? opt2->offset : opt.offset);
+		break;
+	default:
+		field1_repr = GetRawOptionValue(proto, opt, v1);
+		break;
+	}
+}
+
+void OptionModification::Print(std::ostream& out, bool verbose) const
+{
+	switch (change) {
+	case ADDED:
+		out << "+" << GetName();
+		if (verbose)
+			out << " " << field1_repr;
+		break;
+	case REMOVED:
+		out << "-" << GetName();
+		if (verbose)
+			out << " " << field1_repr;
+		break;
+	case REORDERED:
+		out << "~";
+		/* Fall-through */
+	case MODIFIED:
+		Modification::Print(out, verbose);
+		break;
+	}
+}
+
+void OptionModification::Print_JSON(json_object *res, json_object *add,
+		json_object *del, bool verbose) const
+{
+	json_object *dst = res;
+	std::string name = GetName();
+
+	switch (change) {
+	case MODIFIED:
+		Modification::Print_JSON(res, add, del, verbose);
+		return;
+	case REORDERED:
+		name = "~" + name;
+		break;
+	case ADDED:
+		dst = add;
+		break;
+	case REMOVED:
+		dst = del;
+		break;
+	}
+
+	if (verbose) {
+		json_object *modif = json_object_new_object();
+		json_object_object_add(modif, "Info",
+				json_object_new_string(change == REORDERED ?
+					(field1_repr + " -> " + field2_repr).c_str() :
+					field1_repr.c_str()));
+
+		json_object *modif_header = json_object_new_object();
+		json_object_object_add(modif_header, name.c_str(), modif);
+		json_object_array_add(dst, modif_header);
+	} else {
+		json_object_array_add(dst, json_object_new_string(name.c_str()));
+	}
+}
+
+void ComputeOptionDifferences(PacketModifications *modifs, int proto,
+		size_t hdr_offset, const byte *o1, size_t l1,
+		const byte *o2, size_t l2, bool partial)
+{
+	RawOption a[MAX_RAW_OPTIONS], b[MAX_RAW_OPTIONS];
+	int match[MAX_RAW_OPTIONS];
+	/* Position of each option of b among the matched ones, -1 if unmatched */
+	int rank_b[MAX_RAW_OPTIONS];
+	/* Longest increasing subsequence of rank_b over the options of a: the
+	 * length of the one ending at each option, and its previous option */
+	int lis[MAX_RAW_OPTIONS], prev[MAX_RAW_OPTIONS];
+	bool in_order[MAX_RAW_OPTIONS];
+	size_t na = ParseRawOptions(proto, o1, l1, a);
+	size_t nb = ParseRawOptions(proto, o2, l2, b);
+	size_t i, j;
+	int rank = 0, last = -1;
+
+	/* Pair each option with the first unmatched one of the same kind */
+	for (j = 0; j < nb; ++j)
+		rank_b[j] = -1;
+	for (i = 0; i < na; ++i) {
+		match[i] = -1;
+		for (j = 0; j < nb; ++j) {
+			if (rank_b[j] == -1 && a[i].SameKey(b[j])) {
+				match[i] = j;
+				rank_b[j] = 0;
+				break;
+			}
+		}
+	}
+	for (j = 0; j < nb; ++j)
+		if (rank_b[j] != -1)
+			rank_b[j] = rank++;
+
+	/* Only the options outside of it moved, e.g. only MSS when it goes from
+	 * the first place to the last one. On ties, the later options are
+	 * kept in order, so that a swap reports the first option. */
+	for (i = 0; i < na; ++i) {
+		in_order[i] = false;
+		lis[i] = 0;
+		prev[i] = -1;
+		if (match[i] == -1)
+			continue;
+		lis[i] = 1;
+		for (j = 0; j < i; ++j) {
+			if (match[j] != -1 && rank_b[match[j]] < rank_b[match[i]] &&
+					lis[j] + 1 >= lis[i]) {
+				lis[i] = lis[j] + 1;
+				prev[i] = j;
+			}
+		}
+		if (last == -1 || lis[i] >= lis[last])
+			last = i;
+	}
+	for (; last != -1; last = prev[last])
+		in_order[last] = true;
+
+	for (i = 0; i < na; ++i) {
+		const byte *v1 = o1 + a[i].offset;
+
+		if (match[i] == -1) {
+			if (!partial)
+				modifs->push_back(new OptionModification(proto,
+					OptionModification::REMOVED, a[i], hdr_offset, v1, NULL));
+			continue;
+		}
+
+		const RawOption *m = &b[match[i]];
+		const byte *v2 = o2 + m->offset;
+		if (a[i].len != m->len || memcmp(v1, v2, a[i].len))
+			modifs->push_back(new OptionModification(proto,
+				OptionModification::MODIFIED, a[i], hdr_offset, v1, v2, m));
+		if (!in_order[i])
+			modifs->push_back(new OptionModification(proto,
+				OptionModification::REORDERED, a[i], hdr_offset, v1, v2, m));
+	}
+
+	for (j = 0; j < nb; ++j)
+		if (rank_b[j] == -1)
+			modifs->push_back(new OptionModification(proto,
+				OptionModification::ADDED, b[j], hdr_offset, o2 + b[j].offset,
+				NULL));
+}
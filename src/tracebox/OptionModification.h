@@ -0,0 +1,95 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __OPTIONMODIFICATION_H__
+#define __OPTIONMODIFICATION_H__
+
+#include "PacketModification.h"
+
+/* The options area of TCP and IPv4 headers is at most 40 bytes long, thus
+ * cannot hold more than 40 options (all of them being single-byte ones). */
+#define MAX_RAW_OPTIONS 40
+
+/* An option found in a TCP or IPv4 header. It only records where the option
+ * lies in the raw header so that parsing a list of options never allocates
+ * anything.
+ */
+struct RawOption {
+	/* Option kind (TCP) or type (IPv4) */
+	byte kind;
+	/* Secondary key distinguishing options sharing the same kind
+	 * (e.g. the MPTCP subtype or the experimental option ExID) */
+	uint16_t subkind;
+	/* Offset compared to the start of the options area (in bytes) */
+	uint8_t offset;
+	/* Total length of the option, including the kind/length bytes */
+	uint8_t len;
+
+	bool SameKey(const RawOption &o) const {
+		return kind == o.kind && subkind == o.subkind;
+	}
+};
+
+/* Parse the options area of a header of the given protocol (TCP::PROTO or
+ * IP::PROTO). Padding options are skipped. Parsing stops at the end of
+ * the area, at the first EOL or at the first malformed option.
+ * Returns the number of options stored in opts, which must hold at least
+ * MAX_RAW_OPTIONS elements. */
+size_t ParseRawOptions(int proto, const byte *area, size_t len,
+		RawOption *opts);
+
+/* Return the name of an option, as used in the modifications report
+ * (e.g. TCPOption::MSS) */
+std::string GetRawOptionName(int proto, const RawOption &opt);
+
+class OptionModification : public Modification {
+public:
+	enum Change {
+		ADDED,
+		REMOVED,
+		MODIFIED,
+		REORDERED,
+	};
+
+	OptionModification(int proto, Change change, const RawOption &opt,
+			size_t hdr_offset, const byte *v1, const byte *v2,
+			const RawOption *opt2 = NULL);
+
+	Change GetChange() const {
+		return change;
+	}
+
+	byte GetKind() const {
+		return kind;
+	}
+
+	virtual Type GetType() const {
+		return change == ADDED ? Modification::ADDED :
+			change == REMOVED ? Modification::REMOVED : CHANGED;
+	}
+
+	virtual void Print(std::ostream& out, bool verbose = false) const;
+
+	virtual void Print_JSON(json_object *res, json_object *add,
+			json_object *del, bool verbose = false) const;
+
+private:
+	Change change;
+	byte kind;
+};
+
+/* Compare two options areas of the given protocol and add one
+ * OptionModification per option that has been added, removed, modified or
+ * moved. If partial is set, the second area might have been truncated and
+ * missing options are thus not reported as removed.
+ * hdr_offset is the offset of the options area from the start of the header
+ * (in bytes). */
+void ComputeOptionDifferences(PacketModifications *modifs, int proto,
+		size_t hdr_offset, const byte *o1, size_t l1,
+		const byte *o2, size_t l2, bool partial);
+
+#endif
@@ -5,41 +5,58 @@
  *  Some rights reserved. See LICENSE, AUTHORS.
  */
 #include <algorithm>
+#include <mutex>
+#include <unordered_map>
 
 #include "config.h"
+#ifdef HAVE_LIBJSON
+#include <json/json.h>
+#endif
+#ifdef HAVE_JSONC
+#include <json-c/json.h>
+#endif
+
 #include "PacketModification.h"
 #include "PartialHeader.h"
+#include "OptionModification.h"
+#include "LayerIndex.h"
+#include "HeaderDiff.h"
+#include "Timestamp.h"
 
 using namespace std;
 
-static Layer *GetLayer(const Packet *pkt, int proto_id)
+/* Whether the layer of this entry is left out of the comparison */
+static bool IsIgnored(const LayerIndex::Entry *e)
 {
-	for (Layer *l : *pkt) {
-		if (l->GetID() == proto_id)
-			return l;
-	}
-	return NULL;
+	/* Options are compared one by one by ComputeOptionDifferences() */
+	return e->option || e->proto == Crafter::Ethernet::PROTO ||
+		e->proto == Crafter::SLL::PROTO ||
+		e->proto == Crafter::NullLoopback::PROTO;
 }
 
-static set<int> GetAllProtos(const Packet *p1, const Packet *p2)
+/* Starting from e, the first layer of the next protocol to compare */
+static const LayerIndex::Entry *FirstCompared(const LayerIndex &idx,
+		const LayerIndex::Entry *e)
 {
-	set<int> ret;
-
-	for (Layer *l : *p1)
-		ret.insert(l->GetID());
-	for (Layer *l : *p2)
-		ret.insert(l->GetID());
+	while (e != idx.end() && IsIgnored(e))
+		++e;
+	return e;
+}
 
-	/* Remove unwanted layers */
-	ret.erase(Crafter::Ethernet::PROTO);
-	ret.erase(Crafter::SLL::PROTO);
-	ret.erase(Crafter::NullLoopback::PROTO);
+/* The first layer of the protocol to compare after the one of e */
+static const LayerIndex::Entry *NextCompared(const LayerIndex &idx,
+		const LayerIndex::Entry *e)
+{
+	int proto = e->proto;
 
-	return ret;
+	while (e != idx.end() && e->proto == proto)
+		++e;
+	return FirstCompared(idx, e);
 }
 
-static void ComputeDifferences(PacketModifications *modifs,
-						const Layer *l1, const Layer *l2)
+/* Compare the fields of two layers one by one */
+static void ComputeFieldDifferences(PacketModifications *modifs,
+		const Layer *l1, const Layer *l2)
 {
 	byte* this_layer = new byte[l1->GetSize()];
 	byte* that_layer = new byte[l1->GetSize()];
@@ -55,6 +72,27 @@ static void ComputeDifferences(PacketModifications *modifs,
 			modifs->push_back(new Modification(l1->GetID(), l1->GetField(i), l2->GetField(i)));
 	}
 
+	delete[] this_layer;
+	delete[] that_layer;
+}
+
+static void ComputeDifferences(PacketModifications *modifs,
+		const Layer *l1, const byte *raw1, const Layer *l2, const byte *raw2)
+{
+	size_t hdr_len = l1->GetSize() - l1->GetPayload().GetSize();
+	uint32_t fields;
+
+	/* IP, IPv6, TCP and UDP headers are compared in a single pass */
+	if (hdr_len == l2->GetSize() - l2->GetPayload().GetSize() &&
+			DiffFixedHeader(l1, raw1, raw2, &fields)) {
+		for (size_t i = 0; fields; ++i, fields >>= 1)
+			if (fields & 1)
+				modifs->push_back(new Modification(l1->GetID(),
+							l1->GetField(i), l2->GetField(i)));
+	} else {
+		ComputeFieldDifferences(modifs, l1, l2);
+	}
+
 	/* TODO do something more clever here
 	 * (ex: identify the offset where the change occured)
 	 */
@@ -64,35 +102,79 @@ static void ComputeDifferences(PacketModifications *modifs,
 		modifs->push_back(new Deletion(l1));
 	else if (memcmp(l1->GetPayload().GetRawPointer(), l2->GetPayload().GetRawPointer(), l1->GetPayload().GetSize()))
 		modifs->push_back(new Modification(l1, l2));
+}
 
-	delete[] this_layer;
-	delete[] that_layer;
+/* GetRawPtr() only crafts packets that have never been crafted, while we
+ * only compare probes that were sent and packets read from the wire */
+static const byte *GetRaw(const Packet *pkt)
+{
+	return const_cast<Packet *>(pkt)->GetRawPtr();
 }
 
-static PacketModifications* ComputeDifferences(
-		std::shared_ptr<Packet> orig_shared, const Packet *modified,
-		bool partial, std::vector<const Layer*> &extensions)
+/* Locate the options area of the first header of the given protocol in the
+ * raw bytes of the packet. Sets truncated if the packet ends before the end
+ * of the header. */
+static bool GetOptionArea(const Packet *pkt, const LayerIndex &idx, int proto,
+		const byte **area, size_t *len, bool *truncated)
 {
+	const LayerIndex::Entry *e = idx.Find(proto);
 
-	PacketModifications *modifs = new PacketModifications(
-			orig_shared, modified, extensions, partial);
-	if (modified) {
-		const Packet *orig = orig_shared.get();
-		const set<int> protos = GetAllProtos(orig, modified);
+	if (e == idx.end())
+		return false;
+	return GetRawOptionArea(proto, GetRaw(pkt) + e->offset,
+			pkt->GetSize() - e->offset, area, len, truncated);
+}
 
-		for (auto proto : protos) {
-			const Layer *l1 = GetLayer(orig, proto);
-			const Layer *l2 = GetLayer(modified, proto);
+static void CompareOptionAreas(PacketModifications *modifs,
+		const Packet *orig, const LayerIndex &orig_idx,
+		const Packet *modified, const LayerIndex &modified_idx, int proto,
+		bool partial)
+{
+	const byte *o1, *o2 = NULL;
+	size_t l1, l2 = 0;
+	bool truncated = false;
+
+	if (!GetOptionArea(orig, orig_idx, proto, &o1, &l1, &truncated))
+		return;
+	truncated = false;
+	/* A missing header will already be reported as a deletion */
+	GetOptionArea(modified, modified_idx, proto, &o2, &l2, &truncated);
+	ComputeOptionDifferences(modifs, proto, 20, o1, l1, o2, l2,
+			partial || truncated);
+}
 
-			if (l1 && l2)
-				ComputeDifferences(modifs, l1, l2);
-			else if (l1 && !l2 && !partial)
-				modifs->push_back(new Deletion(l1));
-			else if (!l1 && l2)
-				modifs->push_back(new Addition(l2));
+/* Compare the first layer of each protocol of both packets, walking their
+ * indexes in protocol order */
+static void ComputeDifferences(PacketModifications *modifs,
+		const Packet *orig, const LayerIndex &orig_idx,
+		const Packet *modified, const LayerIndex &modified_idx, bool partial)
+{
+	const LayerIndex::Entry *e1 = FirstCompared(orig_idx, orig_idx.begin());
+	const LayerIndex::Entry *e2 =
+		FirstCompared(modified_idx, modified_idx.begin());
+	const byte *raw1 = GetRaw(orig), *raw2 = GetRaw(modified);
+
+	while (e1 != orig_idx.end() || e2 != modified_idx.end()) {
+		if (e2 == modified_idx.end() ||
+				(e1 != orig_idx.end() && e1->proto < e2->proto)) {
+			if (!partial)
+				modifs->push_back(new Deletion(e1->layer));
+			e1 = NextCompared(orig_idx, e1);
+		} else if (e1 == orig_idx.end() || e2->proto < e1->proto) {
+			modifs->push_back(new Addition(e2->layer));
+			e2 = NextCompared(modified_idx, e2);
+		} else {
+			ComputeDifferences(modifs, e1->layer, raw1 + e1->offset,
+					e2->layer, raw2 + e2->offset);
+			e1 = NextCompared(orig_idx, e1);
+			e2 = NextCompared(modified_idx, e2);
 		}
 	}
-	return modifs;
+
+	CompareOptionAreas(modifs, orig, orig_idx, modified, modified_idx,
+			IP::PROTO, partial);
+	CompareOptionAreas(modifs, orig, orig_idx, modified, modified_idx,
+			TCP::PROTO, partial);
 }
 
 Packet *TrimReply(Packet *rcv, bool *partial, size_t ip_total_len,
@@ -159,97 +241,407 @@ Packet* TrimReplyIPv6(Packet *rcv, bool *partial,
 			ip->GetNextHeader(), extensions);
 }
 
-static int find_layers_locations(Packet *rcv, int *proto, RawLayer **raw,
-		std::vector<const Layer *> &extensions)
+/* Largest header compared without allocating the field masks */
+#define MAX_STACK_HEADER 64
+
+/* Whether the quote holds the very same headers as the probe, in which case
+ * both can be compared byte by byte using the layout of the probe */
+static bool SameLayout(const Packet *probe, const QuoteView &quote)
 {
-	if (!rcv)
-		return -1;
-	size_t layer_pos;
-	int icmp_loc = 0;
-	const Layer *layer;
-	/* Find the IP Layer to know the version */
-	for (layer_pos = 0; layer_pos < rcv->GetLayerCount()
-			&& *proto != IP::PROTO
-			&& *proto != IPv6::PROTO; ++layer_pos) {
-		layer = (*rcv)[layer_pos];
-		*proto = layer->GetID();
+	const byte *raw, *q = quote.GetQuote();
+	size_t net_len = quote.GetNetworkHeaderSize();
+	size_t trans_len = quote.GetTransportHeaderSize();
+	int proto = quote.GetTransportProto();
+
+	if (!quote.IsQuote() || quote.IsTruncated() || !trans_len ||
+			quote.GetQuoteSize() != probe->GetSize() ||
+			!probe->GetLayerCount() ||
+			(*probe)[0]->GetID() != quote.GetNetworkProto())
+		return false;
+
+	raw = GetRaw(probe);
+	if (quote.GetNetworkProto() == IP::PROTO) {
+		if ((raw[0] & 0x0f) != (q[0] & 0x0f) || raw[9] != proto)
+			return false;
+	} else if (raw[6] != proto) {
+		return false;
+	}
+	/* The UDP header has a fixed size */
+	return proto != TCP::PROTO ||
+		(raw[net_len + 12] >> 4) == (q[net_len + 12] >> 4);
+}
+
+/* Record the values of field f of layer l read from both raw headers */
+static void CompareRawField(PacketModifications *modifs, const Layer *l,
+		const FieldInfo *f, const byte *a, const byte *b)
+{
+	FieldInfo *f1 = f->Clone(), *f2 = f->Clone();
+
+	f1->Read(a);
+	f2->Read(b);
+	modifs->push_back(new Modification(l->GetID(), f1, f2));
+	delete f1;
+	delete f2;
+}
+
+/* Compare the header of layer l in two raw buffers holding it at the same
+ * place. Headers without a specialized layout have their fields located by
+ * writing them over blank headers, so that the bits they span do not depend
+ * on how libcrafter numbers them. */
+static void CompareRawHeader(PacketModifications *modifs, const Layer *l,
+		const byte *a, const byte *b, size_t hdr_len)
+{
+	byte stack_masks[2 * MAX_STACK_HEADER];
+	byte *zeros, *ones;
+	uint32_t fields;
+
+	if (DiffFixedHeader(l, a, b, &fields)) {
+		for (size_t i = 0; fields; ++i, fields >>= 1)
+			if (fields & 1)
+				CompareRawField(modifs, l, l->GetField(i), a, b);
+		return;
 	}
-	if (layer_pos >= rcv->GetLayerCount())
-		/* No IP layer */
-		return -1;
-	layer = (*rcv)[layer_pos];
-	if (layer->GetID() != ICMP::PROTO && layer->GetID() != ICMPv6::PROTO)
-		/* No ICMP Layer */
-		return -1;
-	/* Register the ICMP Layer location */
-	icmp_loc = layer_pos++;
-	/* Find the Raw Layer itself and register its location as it contains
-	 * the echoed packet */
-	if (layer_pos >= rcv->GetLayerCount() ||
-			!(*raw = rcv->GetLayer<RawLayer>(layer_pos++)))
-		/* No raw layer, i.e. incorrect ICMP reply for our use case */
-		return -1;
-	/* Keep track of any ICMP extension */
-	for (; layer_pos < rcv->GetLayerCount(); ++layer_pos) {
-		Layer *layer = (*rcv)[layer_pos];
-		Layer *new_layer = Protocol::AccessFactory()->GetLayerByID(layer->GetID());
-		*new_layer = *layer;
-		extensions.push_back(new_layer);
+
+	zeros = hdr_len <= MAX_STACK_HEADER ? stack_masks : new byte[2 * hdr_len];
+	ones = zeros + hdr_len;
+	for (size_t i = 0 ; i < l->GetFieldsSize() ; i++) {
+		const FieldInfo *f = l->GetField(i);
+		bool differ = false;
+
+		memset(zeros, 0, hdr_len);
+		memset(ones, 0xff, hdr_len);
+		f->Write(zeros);
+		f->Write(ones);
+		/* Only look at the bits the field spans, i.e. those that
+		 * Write() made equal on both blank headers */
+		for (size_t j = 0; j < hdr_len && !differ; ++j)
+			differ = (a[j] ^ b[j]) & ~(zeros[j] ^ ones[j]);
+		if (differ)
+			CompareRawField(modifs, l, f, a, b);
 	}
-	return icmp_loc;
+
+	if (zeros != stack_masks)
+		delete[] zeros;
 }
 
-PacketModifications* PacketModifications::ComputeModifications(
-		std::shared_ptr<Crafter::Packet> pkt, Crafter::Packet *rcv)
-{
-	bool partial = false;
-	std::vector<const Layer*> extensions;
-	int proto, icmp_loc;
-	RawLayer *raw;
-	/* It should normally be impossible to have an ICMP Layer at index 0 as it
-	 * would indicate that we received it without an encapsulating IP header
-	 * which is impossible unless the user explicitely crafts (incorrect)
-	 * responses */
-	icmp_loc = find_layers_locations(rcv, &proto, &raw, extensions);
-	if (icmp_loc > 0) {
-		/* If there are ICMP extensions, then the raw-sandwich layer might
-		 * include padding ... */
-		int len_without_padding = raw->GetSize();
-		Packet *cnt = new Packet(rcv->GetTimestamp());
-		switch (proto) {
-		case IP::PROTO: {
-			ICMP *icmp = rcv->GetLayer<ICMP>(icmp_loc);
-			if (icmp->GetLength())
-				len_without_padding = std::min(len_without_padding,
-						icmp->GetLength() * 4);
-			cnt->PacketFromIP(raw->GetRawPointer(),
-					len_without_padding);
-			/* We might receive an ICMP without the complete
-			 * echoed packet or with ICMP extensions. We thus
-			 * remove undesired parts and parse partial headers.
-			 */
-			cnt = TrimReplyIPv4(cnt, &partial, extensions);
-			break;
-		}
-		case IPv6::PROTO: {
-			ICMPv6 *icmp = rcv->GetLayer<ICMPv6>(icmp_loc);
-			if (icmp->GetLength())
-				len_without_padding = std::min(len_without_padding,
-						icmp->GetLength() * 8);
-			cnt->PacketFromIPv6(raw->GetRawPointer(),
-					len_without_padding);
-			cnt = TrimReplyIPv6(cnt, &partial, extensions);
-			break;
-		}
-		default:
-			delete cnt;
-			cnt = NULL;
+/* Compare a quote to the probe (or to the quote of a previous hop) without
+ * parsing it, both having the layout of probe as checked by SameLayout().
+ * Returns false if the probe has too many layers to do so. */
+static bool ComputeRawDifferences(PacketModifications *modifs,
+		const Packet *probe, const LayerIndex &probe_idx, const byte *ref,
+		const byte *quote)
+{
+	size_t net_len, size = probe->GetSize();
+	const byte *o1, *o2;
+	size_t l1, l2;
+	bool truncated;
+
+	if (!probe_idx.IsComplete())
+		return false;
+	for (const LayerIndex::Entry *e = FirstCompared(probe_idx,
+				probe_idx.begin()); e != probe_idx.end();
+			e = NextCompared(probe_idx, e)) {
+		const Layer *l = e->layer;
+		size_t off = e->offset;
+		size_t payload_len = l->GetPayload().GetSize();
+		size_t hdr_len = l->GetSize() - payload_len;
+
+		CompareRawHeader(modifs, l, ref + off, quote + off, hdr_len);
+		off += hdr_len;
+		if (memcmp(ref + off, quote + off, payload_len)) {
+			/* Same record as the parsed path, which compares l to
+			 * the layer of the same type in the quote */
+			Layer *received =
+				Protocol::AccessFactory()->GetLayerByID(l->GetID());
+			received->PutData(quote + e->offset);
+			received->SetPayload(quote + off, payload_len);
+			modifs->push_back(new Modification(l, received));
+			delete received;
 		}
+	}
+
+	if ((*probe)[0]->GetID() == IP::PROTO) {
+		net_len = (ref[0] & 0x0f) * 4;
+		GetRawOptionArea(IP::PROTO, ref, size, &o1, &l1, &truncated);
+		GetRawOptionArea(IP::PROTO, quote, size, &o2, &l2, &truncated);
+		ComputeOptionDifferences(modifs, IP::PROTO, 20, o1, l1, o2, l2,
+				false);
+	} else {
+		net_len = 40;
+	}
+	if (ref[(*probe)[0]->GetID() == IP::PROTO ? 9 : 6] == TCP::PROTO) {
+		GetRawOptionArea(TCP::PROTO, ref + net_len, size - net_len,
+				&o1, &l1, &truncated);
+		GetRawOptionArea(TCP::PROTO, quote + net_len, size - net_len,
+				&o2, &l2, &truncated);
+		ComputeOptionDifferences(modifs, TCP::PROTO, 20, o1, l1, o2, l2,
+				false);
+	}
+	return true;
+}
+
+/* Build the packet quoted by an ICMP error as libcrafter parses it */
+static Packet *MaterializeQuote(const QuoteView &quote,
+		const struct timeval &ts, bool *partial)
+{
+	std::vector<const Layer*> trailer;
+	Packet *pkt = quote.Materialize(ts);
 
-		delete rcv;
-		rcv = cnt;
+	*partial = false;
+	if (!pkt)
+		return NULL;
+	if (quote.GetNetworkProto() == IP::PROTO)
+		pkt = TrimReplyIPv4(pkt, partial, trailer);
+	else
+		pkt = TrimReplyIPv6(pkt, partial, trailer);
+	/* Extensions are decoded from the reply by ICMPExtensions */
+	for (const Layer *l : trailer)
+		delete l;
+	return pkt;
+}
+
+/* Compare the quote of modifs to its probe, or to the quote of the reply
+ * prev if given */
+static void ComputeQuoteDifferences(PacketModifications *modifs,
+		const Packet *prev)
+{
+	const Packet *probe = modifs->orig.get();
+	const LayerIndex probe_idx(probe);
+	QuoteView prev_quote(prev);
+	bool partial;
+
+	if (SameLayout(probe, modifs->quote) &&
+			(!prev || SameLayout(probe, prev_quote)) &&
+			ComputeRawDifferences(modifs, probe, probe_idx,
+				prev ? prev_quote.GetQuote() : GetRaw(probe),
+				modifs->quote.GetQuote()))
+		return;
+
+	/* Some headers have been truncated, resized or replaced, let libcrafter
+	 * parse the quotes */
+	std::shared_ptr<const Packet> modified = modifs->GetReceived();
+	if (!modified)
+		return;
+	const LayerIndex modified_idx(modified.get());
+	/* TrimReply() replaces truncated transport headers by partial ones */
+	modifs->partial = modified_idx.Get(PartialTCP::PROTO) != NULL;
+	if (prev) {
+		Packet *ref = MaterializeQuote(prev_quote, prev->GetTimestamp(),
+				&partial);
+		if (ref)
+			ComputeDifferences(modifs, ref, LayerIndex(ref),
+					modified.get(), modified_idx, modifs->partial);
+		delete ref;
+	} else {
+		ComputeDifferences(modifs, probe, probe_idx, modified.get(),
+				modified_idx, modifs->partial);
 	}
-	return ComputeDifferences(pkt, rcv, partial, extensions);
+}
+
+PacketModifications* PacketModifications::ComputeModifications(
+		std::shared_ptr<Crafter::Packet> pkt, Crafter::Packet *rcv,
+		const std::shared_ptr<const Crafter::Packet> previous)
+{
+	PacketModifications *modifs = new PacketModifications(pkt,
+			std::shared_ptr<const Packet>(rcv));
+
+	if (!rcv)
+		return modifs;
+	if (rcv->GetLayer<IPLayer>())
+		modifs->router = rcv->GetLayer<IPLayer>()->GetSourceIP();
+	/* The probe is sent again at the next hop, record the delay now */
+	modifs->rtt = ts_ns(rcv->GetTimestamp()) - ts_ns(pkt->GetTimestamp());
+	if (!modifs->quote.IsQuote()) {
+		ComputeDifferences(modifs, pkt.get(), LayerIndex(pkt.get()), rcv,
+				LayerIndex(rcv), false);
+		return modifs;
+	}
+
+	modifs->quoted = true;
+	/* Only quotes are compared to the quote of the previous hop */
+	if (previous && QuoteView(previous.get()).IsQuote()) {
+		modifs->previous = previous;
+		modifs->incremental = true;
+		/* Right away, as the probe is updated for the next hop */
+		modifs->cumulative = new PacketModifications(pkt, modifs->reply);
+		modifs->cumulative->quoted = true;
+		modifs->cumulative->router = modifs->router;
+		ComputeQuoteDifferences(modifs->cumulative, NULL);
+	}
+	ComputeQuoteDifferences(modifs, modifs->previous.get());
+	return modifs;
+}
+
+std::shared_ptr<const Packet> PacketModifications::GetReceived() const
+{
+	bool partial;
+
+	if (!quote.IsQuote())
+		return reply;
+	if (!modif)
+		modif.reset(MaterializeQuote(quote, reply->GetTimestamp(),
+					&partial));
+	return modif;
+}
+
+const PacketModifications* PacketModifications::GetCumulative() const
+{
+	if (!cumulative)
+		return this;
+	/* The RTT can be corrected once the modifications are computed */
+	cumulative->rtt = rtt;
+	return cumulative;
+}
+
+void PacketModifications::Compact(size_t snippet_len)
+{
+	const byte *ext;
+	size_t ext_len;
+
+	if (compact)
+		return;
+	if (cumulative)
+		cumulative->Compact(snippet_len);
+
+	if (quote.IsQuote())
+		snippet.assign(quote.GetQuote(), quote.GetQuote() +
+				min(snippet_len, quote.GetQuoteSize()));
+	/* The extensions point to the reply */
+	ext = quote.GetExtensions(&ext_len);
+	if (ext) {
+		ext_data.assign(ext, ext + ext_len);
+		extensions = ICMPExtensions(ext_data.data(), ext_data.size());
+	}
+	quote = QuoteView();
+
+	if (reply)
+		PacketRing::Push(orig, reply);
+	orig.reset();
+	reply.reset();
+	previous.reset();
+	modif.reset();
+	compact = true;
+}
+
+std::string PacketModifications::GetFingerprint() const
+{
+	std::vector<std::string> names;
+	std::ostringstream ss;
+	std::string fingerprint = partial ? "[PARTIAL]" : "";
+
+	names.reserve(size());
+	for (const_iterator it = begin(); it != end(); ++it) {
+		ss.str("");
+		(*it)->Print(ss);
+		names.push_back(ss.str());
+	}
+	sort(names.begin(), names.end());
+	for (auto &name : names) {
+		if (!fingerprint.empty())
+			fingerprint += " ";
+		fingerprint += name;
+	}
+	return fingerprint;
+}
+
+bool PacketModifications::Has(const std::string &name) const
+{
+	if (!indexed) {
+		for (const_iterator it = begin(); it != end(); ++it) {
+			const Modification *m = *it;
+			std::string layer = m->GetLayerName();
+
+			names.insert(m->GetName());
+			names.insert(layer);
+			switch (m->GetType()) {
+			case Modification::ADDED:
+				names.insert("+" + m->GetName());
+				names.insert("+" + layer);
+				break;
+			case Modification::REMOVED:
+				names.insert("-" + m->GetName());
+				names.insert("-" + layer);
+				break;
+			default:
+				break;
+			}
+		}
+		indexed = true;
+	}
+	return names.count(name) > 0;
+}
+
+uint32_t ModificationPatterns::Intern(const std::string &fingerprint,
+		bool *added)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = ids.insert({fingerprint, names.size()});
+
+	if (it.second)
+		names.push_back(&it.first->first);
+	if (added)
+		*added = it.second;
+	return it.first->second;
+}
+
+const std::string *ModificationPatterns::Get(uint32_t id)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return id < names.size() ? names[id] : NULL;
+}
+
+size_t ModificationPatterns::size()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return names.size();
+}
+
+static std::mutex ring_lock;
+static std::vector<PacketRing::Entry> ring;
+/* Capacity of the ring, and position of its next entry */
+static size_t ring_capacity, ring_head;
+
+size_t PacketRing::SetCapacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> guard(ring_lock);
+	size_t old = ring_capacity;
+
+	ring.clear();
+	ring.shrink_to_fit();
+	ring_capacity = capacity;
+	ring_head = 0;
+	return old;
+}
+
+void PacketRing::Push(const std::shared_ptr<const Packet> &orig,
+		const std::shared_ptr<const Packet> &reply)
+{
+	std::lock_guard<std::mutex> guard(ring_lock);
+	Entry e;
+
+	if (!ring_capacity)
+		return;
+	e.orig = orig ? std::make_shared<const Packet>(*orig) : orig;
+	e.reply = reply;
+	if (ring.size() < ring_capacity)
+		ring.push_back(e);
+	else
+		ring[ring_head] = e;
+	ring_head = (ring_head + 1) % ring_capacity;
+}
+
+std::vector<PacketRing::Entry> PacketRing::Get()
+{
+	std::lock_guard<std::mutex> guard(ring_lock);
+	std::vector<Entry> entries;
+
+	entries.reserve(ring.size());
+	/* Until the ring is full, ring_head is its size */
+	for (size_t i = 0; i < ring.size(); ++i)
+		entries.push_back(ring[(ring_head + i) % ring.size()]);
+	return entries;
 }
 
 Modification::Modification(int proto, std::string name, size_t offset,
@@ -404,13 +796,7 @@ void PacketModifications::Print(std::ostream& out, bool verbose) const
 	}
 	if (extensions.size() > 0) {
 		out << "[Extra headers: ";
-		for (std::vector<const Layer *>::const_iterator it = extensions.begin();
-				it != extensions.end();	++it) {
-			if (verbose) {
-				(*it)->Print(out);
-				out << " ";
-			} else out << (*it)->GetName() << " ";
-		}
+		extensions.Print(out, verbose);
 		out << "] ";
 	}
 }
@@ -423,35 +809,13 @@ void PacketModifications::Print_JSON(json_object *res,
 		(*it)->Print_JSON(res, add, del, verbose);
 	if (extensions.size() > 0) {
 		*ext = json_object_new_array();
-		for (std::vector<const Layer *>::const_iterator it = extensions.begin();
-				it != extensions.end();	++it) {
-			if (verbose) {
-				std::ostringstream ss;
-				(*it)->Print(ss);
-				std::string str = ss.str();
-				str.erase(std::remove(str.begin(), str.end(), '\n'), str.end());
-
-				json_object *descr = json_object_new_object();
-				json_object_object_add(descr, "Info",
-						json_object_new_string(str.c_str()));
-
-				json_object *descr_hdr = json_object_new_object();
-				json_object_object_add(descr_hdr, (*it)->GetName().c_str(),
-						descr);
-				json_object_array_add(*ext, descr_hdr);
-			} else {
-				json_object_array_add(*ext, json_object_new_string(
-							(*it)->GetName().c_str()));
-			}
-		}
+		extensions.Print_JSON(*ext, verbose);
 	}
 }
 
 PacketModifications::~PacketModifications()
 {
-	for (std::vector<const Layer *>::const_iterator it = extensions.begin();
-			it != extensions.end(); ++it)
-		delete *it;
+	delete cumulative;
 	for(const_iterator it = begin() ; it != end() ; ++it)
 		delete *it;
 	clear();
@@ -9,14 +9,17 @@
 #define __PACKETMODIFICATION_H__
 
 #include "crafter.h"
-#ifdef HAVE_LIBJSON
-#include <json/json.h>
-#endif
-#ifdef HAVE_JSONC
-#include <json-c/json.h>
-#endif
 
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "QuoteView.h"
+#include "ICMPExtension.h"
+
+/* From json-c, which only the implementation needs */
+struct json_object;
 
 using namespace Crafter;
 
@@ -45,6 +48,13 @@ protected:
 	std::string field2_repr;
 
 public:
+	/* How the field, layer or option named by GetName() differs */
+	enum Type {
+		CHANGED,
+		ADDED,
+		REMOVED,
+	};
+
 	Modification(int proto, std::string name, size_t offset, size_t len);
 	Modification(int proto, const FieldInfo *f1, const FieldInfo *f2);
 	Modification(const Layer *l1, const Layer *l2);
@@ -65,6 +75,30 @@ public:
 		return name;
 	}
 
+	int GetLayerProto() const {
+		return layer_proto;
+	}
+
+	/* The name of the layer, i.e. the part of the name before any ::
+	 * (e.g. IP for IP::TTL) */
+	std::string GetLayerName() const {
+		return name.substr(0, name.find("::"));
+	}
+
+	virtual Type GetType() const {
+		return CHANGED;
+	}
+
+	/* The values before and after the modification, as printed in
+	 * verbose mode. Additions and deletions only have the first one. */
+	const std::string& GetOldValue() const {
+		return field1_repr;
+	}
+
+	const std::string& GetNewValue() const {
+		return field2_repr;
+	}
+
 	virtual ~Modification() {}
 
 	virtual void Print(std::ostream& out = std::cout,
@@ -77,6 +111,10 @@ public:
 struct Addition : public Modification {
 	Addition(const Layer *l);
 
+	virtual Type GetType() const {
+		return ADDED;
+	}
+
 	virtual void Print(std::ostream& out, bool verbose = false) const;
 
 	virtual void Print_JSON(json_object *res, json_object *add,
@@ -86,32 +124,155 @@ struct Addition : public Modification {
 struct Deletion : public Modification {
 	Deletion(const Layer *l);
 
+	virtual Type GetType() const {
+		return REMOVED;
+	}
+
 	virtual void Print(std::ostream& out, bool verbose = false) const;
 
 	virtual void Print_JSON(json_object *res, json_object *add,
 			json_object *del, bool verbose = false) const;
 };
 
+/* Gives a small integer ID to each distinct set of modifications, as
+ * fingerprinted by PacketModifications::GetFingerprint(), so that the hops
+ * and traces showing the same pattern share it. The IDs are only
+ * meaningful within their table, which can be used from any thread. */
+class ModificationPatterns {
+	std::mutex lock;
+	std::unordered_map<std::string, uint32_t> ids;
+	/* Keys of ids, by ID */
+	std::vector<const std::string *> names;
+
+public:
+	/* Return the ID of the fingerprint, registering it if needed, in
+	 * which case added is set */
+	uint32_t Intern(const std::string &fingerprint, bool *added = NULL);
+
+	/* Return the fingerprint of an ID, NULL if it is unknown */
+	const std::string *Get(uint32_t id);
+
+	size_t size();
+};
+
+/* Length of the quote kept by compact modifications, enough for the IPv4 or
+ * IPv6 and TCP headers of the default probes */
+#define DEFAULT_QUOTE_SNIPPET_LEN 64
+
+/* Keeps the packets released by the last compacted modifications, for
+ * debugging. The ring is global to the process and disabled by default. */
+class PacketRing {
+public:
+	struct Entry {
+		std::shared_ptr<const Packet> orig;
+		std::shared_ptr<const Packet> reply;
+	};
+
+	/* Keep up to capacity entries, 0 to disable the ring. Returns the
+	 * previous capacity. */
+	static size_t SetCapacity(size_t capacity);
+
+	/* Record the packets if the ring is enabled. The probe is copied, as
+	 * tracebox sends the same one at each hop. */
+	static void Push(const std::shared_ptr<const Packet> &orig,
+			const std::shared_ptr<const Packet> &reply);
+
+	/* Entries from the oldest to the most recent one */
+	static std::vector<Entry> Get();
+};
+
 struct PacketModifications : public std::vector<Modification *> {
-	const std::shared_ptr<const Packet> orig;
-	const std::shared_ptr<const Packet> modif;
-	std::vector<const Layer*> extensions;
+	/* Both packets are released by Compact() */
+	std::shared_ptr<const Packet> orig;
+	/* The packet received in response to orig */
+	std::shared_ptr<const Packet> reply;
+	/* The packet quoted by reply, if it is an ICMP error */
+	QuoteView quote;
+	/* The extensions appended to reply, if it is an ICMP error */
+	ICMPExtensions extensions;
 	bool partial;
+	/* Whether the modifications have been computed on the quote */
+	bool quoted;
+	/* In incremental mode, the reply of the previous responsive hop of
+	 * which the quote has been used as reference instead of orig */
+	std::shared_ptr<const Packet> previous;
+	/* Source address of reply, empty if there is none */
+	std::string router;
+	/* Delay between orig and reply (in nsec), -1 if there is no reply.
+	 * The reply is timestamped by the kernel as it is captured. */
+	int64_t rtt;
 
-	PacketModifications(const std::shared_ptr<Packet> orig,
-			const Packet *modif, std::vector<const Layer*> &ext,
-			bool partial=false) :
-		orig(orig), modif(modif), extensions(ext), partial(partial) {}
+	PacketModifications(const std::shared_ptr<const Packet> orig,
+			const std::shared_ptr<const Packet> reply, bool partial=false) :
+		orig(orig), reply(reply), quote(reply.get()), extensions(quote),
+		partial(partial), quoted(false), rtt(-1), compact(false),
+		incremental(false), cumulative(NULL), indexed(false) {}
 	virtual ~PacketModifications();
 
 	void Print(std::ostream& out = std::cout, bool verbose = false) const;
 
+	/* Compute the modifications between pkt and the received reply rcv,
+	 * which is then owned by the modifications. If rcv is an ICMP error,
+	 * its quote is compared without being parsed whenever it has the same
+	 * headers as pkt. If previous is given and both replies are ICMP errors,
+	 * only the changes between their quotes are reported. */
 	static PacketModifications* ComputeModifications(
 			const std::shared_ptr<Crafter::Packet> pkt,
-			Crafter::Packet *rcv);
+			Crafter::Packet *rcv,
+			const std::shared_ptr<const Crafter::Packet> previous = NULL);
+
+	bool IsIncremental() const {
+		return incremental;
+	}
+
+	/* Release the packets, only keeping the modifications, the router,
+	 * the RTT, the extensions and the first snippet_len bytes of the
+	 * quote. The packets are handed to the PacketRing if it is enabled. */
+	void Compact(size_t snippet_len = DEFAULT_QUOTE_SNIPPET_LEN);
+
+	bool IsCompact() const {
+		return compact;
+	}
+
+	/* The beginning of the quote kept by Compact(), empty before */
+	const std::vector<byte>& GetQuoteSnippet() const {
+		return snippet;
+	}
+
+	/* The modifications between the original probe and the received packet,
+	 * regardless of any incremental computation. They are computed along
+	 * with the incremental ones, as the probe changes at the next hop, and
+	 * owned by this object. */
+	const PacketModifications* GetCumulative() const;
+
+	/* The packet that has been compared to orig, i.e. the quote if reply is
+	 * an ICMP error and reply itself otherwise. Quotes are only parsed on
+	 * first use. */
+	std::shared_ptr<const Packet> GetReceived() const;
+
+	/* Canonical representation of the set of modifications, i.e. their
+	 * names as printed by Print() in lexicographic order */
+	std::string GetFingerprint() const;
+
+	/* Whether a modification has the given name (e.g. IP::TTL), or is
+	 * in the given layer (e.g. IP). Names prefixed by + or - only match
+	 * additions or deletions. The names are indexed on first use. */
+	bool Has(const std::string &name) const;
 
 	virtual void Print_JSON(json_object *res, json_object *add,
 			json_object *del, json_object **ext, bool verbose = false) const;
+
+private:
+	bool compact;
+	std::vector<byte> snippet;
+	/* Copy of the extensions, decoded by extensions once compact */
+	std::vector<byte> ext_data;
+	/* Whether previous has been used, even once compact */
+	bool incremental;
+	PacketModifications *cumulative;
+	mutable std::shared_ptr<const Packet> modif;
+	mutable bool indexed;
+	mutable std::unordered_set<std::string> names;
 };
 
 #endif
@@ -0,0 +1,205 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include <algorithm>
+
+#include "config.h"
+#include "QuoteView.h"
+
+using namespace std;
+
+#define IPPROTO_ICMP_NUM	1
+#define IPPROTO_ICMPV6_NUM	58
+
+/* Length of the original datagram field when extensions are appended by
+ * routers predating RFC 4884 */
+#define ICMP_COMPAT_DATAGRAM_LEN	128
+
+static bool IsICMPError(int family, byte type)
+{
+	if (family == IP::PROTO)
+		/* Unreachable, source quench, redirect, time exceeded and
+		 * parameter problem */
+		return type == 3 || type == 4 || type == 5 || type == 11 ||
+			type == 12;
+	/* Unreachable, packet too big, time exceeded and parameter problem */
+	return type >= 1 && type <= 4;
+}
+
+QuoteView::QuoteView(const Packet *reply) :
+	quote(NULL), quote_len(0), declared_len(0), datagram_len(0), family(0),
+	ext(NULL), ext_len(0)
+{
+	size_t off = 0, end, hdr_len;
+	const byte *raw, *icmp;
+	int proto = 0;
+
+	if (!reply)
+		return;
+
+	for (Layer *l : *reply) {
+		proto = l->GetID();
+		if (proto == IP::PROTO || proto == IPv6::PROTO)
+			break;
+		off += l->GetSize();
+	}
+	if (proto != IP::PROTO && proto != IPv6::PROTO)
+		return;
+
+	/* GetRawPtr() only crafts packets that have never been crafted, while
+	 * replies are read from the wire */
+	raw = const_cast<Packet *>(reply)->GetRawPtr() + off;
+	end = reply->GetSize() - off;
+	if (proto == IP::PROTO) {
+		if (end < 20 || raw[9] != IPPROTO_ICMP_NUM)
+			return;
+		hdr_len = (raw[0] & 0x0f) * 4;
+		/* Ignore any link-layer padding */
+		end = min(end, (size_t)((raw[2] << 8) | raw[3]));
+	} else {
+		if (end < 40 || raw[6] != IPPROTO_ICMPV6_NUM)
+			return;
+		hdr_len = 40;
+		end = min(end, (size_t)((raw[4] << 8) | raw[5]) + 40);
+	}
+	if (end < hdr_len + 8)
+		return;
+
+	icmp = raw + hdr_len;
+	if (!IsICMPError(proto, icmp[0]))
+		return;
+
+	family = proto;
+	quote = icmp + 8;
+	datagram_len = end - hdr_len - 8;
+	/* RFC 4884 length of the original datagram field, in 32-bit words for
+	 * ICMP and 64-bit words for ICMPv6 */
+	if (proto == IP::PROTO && icmp[5])
+		ext_len = icmp[5] * 4;
+	else if (proto == IPv6::PROTO && icmp[4])
+		ext_len = icmp[4] * 8;
+	else if (proto == IP::PROTO &&
+			datagram_len >= ICMP_COMPAT_DATAGRAM_LEN + 4 &&
+			(quote[ICMP_COMPAT_DATAGRAM_LEN] >> 4) == 2)
+		ext_len = ICMP_COMPAT_DATAGRAM_LEN;
+	if (ext_len && ext_len < datagram_len) {
+		ext = quote + ext_len;
+		ext_len = datagram_len - ext_len;
+		datagram_len = ext - quote;
+	} else {
+		ext_len = 0;
+	}
+
+	quote_len = datagram_len;
+	if (proto == IP::PROTO && datagram_len >= 20 && (quote[0] >> 4) == 4)
+		declared_len = (quote[2] << 8) | quote[3];
+	else if (proto == IPv6::PROTO && datagram_len >= 40 &&
+			(quote[0] >> 4) == 6)
+		declared_len = ((quote[4] << 8) | quote[5]) + 40;
+	if (declared_len)
+		quote_len = min(quote_len, declared_len);
+}
+
+size_t QuoteView::GetNetworkHeaderSize() const
+{
+	size_t hdr_len;
+
+	if (!declared_len)
+		return 0;
+	hdr_len = family == IP::PROTO ? (quote[0] & 0x0f) * 4 : 40;
+	return hdr_len <= quote_len ? hdr_len : 0;
+}
+
+int QuoteView::GetTransportProto() const
+{
+	if (!declared_len)
+		return -1;
+	return family == IP::PROTO ? quote[9] : quote[6];
+}
+
+size_t QuoteView::GetTransportHeaderSize() const
+{
+	size_t off = GetNetworkHeaderSize(), hdr_len;
+
+	if (!off)
+		return 0;
+	switch (GetTransportProto()) {
+	case TCP::PROTO:
+		if (off + 20 > quote_len)
+			return 0;
+		hdr_len = (quote[off + 12] >> 4) * 4;
+		break;
+	case UDP::PROTO:
+		hdr_len = 8;
+		break;
+	default:
+		return 0;
+	}
+	return off + hdr_len <= quote_len ? hdr_len : 0;
+}
+
+bool GetRawOptionArea(int proto, const byte *hdr, size_t avail,
+		const byte **area, size_t *len, bool *truncated)
+{
+	size_t hdr_len;
+
+	if (avail < 20)
+		return false;
+	switch (proto) {
+	case IP::PROTO:
+		hdr_len = (hdr[0] & 0x0f) * 4;
+		break;
+	case TCP::PROTO:
+		hdr_len = (hdr[12] >> 4) * 4;
+		break;
+	default:
+		return false;
+	}
+
+	*truncated = hdr_len > avail;
+	hdr_len = min(hdr_len, avail);
+	*area = hdr + 20;
+	*len = hdr_len > 20 ? hdr_len - 20 : 0;
+	return true;
+}
+
+bool QuoteView::GetOptionArea(int proto, const byte **area, size_t *len,
+		size_t *hdr_offset, bool *truncated) const
+{
+	size_t off = 0;
+
+	switch (proto) {
+	case IP::PROTO:
+		if (family != IP::PROTO)
+			return false;
+		break;
+	case TCP::PROTO:
+		off = GetNetworkHeaderSize();
+		if (!off || GetTransportProto() != TCP::PROTO)
+			return false;
+		break;
+	default:
+		return false;
+	}
+	*hdr_offset = off;
+	return GetRawOptionArea(proto, quote + off, quote_len - off, area, len,
+			truncated);
+}
+
+Packet *QuoteView::Materialize(const struct timeval &ts) const
+{
+	Packet *pkt;
+
+	if (!quote)
+		return NULL;
+	pkt = new Packet(ts);
+	if (family == IP::PROTO)
+		pkt->PacketFromIP(quote, datagram_len);
+	else
+		pkt->PacketFromIPv6(quote, datagram_len);
+	return pkt;
+}
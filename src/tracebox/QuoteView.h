@@ -0,0 +1,96 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __QUOTEVIEW_H__
+#define __QUOTEVIEW_H__
+
+#include "crafter.h"
+
+using namespace Crafter;
+
+/* A read-only view over the packet quoted by an ICMP error. It only records
+ * offsets in the raw bytes of the reply, which must thus outlive the view,
+ * and decodes the quoted headers on demand without allocating anything.
+ */
+class QuoteView {
+	/* Quoted packet, trimmed to the length announced by its header */
+	const byte *quote;
+	size_t quote_len;
+	/* Length announced by the quoted network header, 0 if unknown */
+	size_t declared_len;
+	/* Length of the original datagram field of the ICMP (RFC 4884) */
+	size_t datagram_len;
+	/* IP::PROTO or IPv6::PROTO */
+	int family;
+	/* ICMP extension structure following the original datagram field */
+	const byte *ext;
+	size_t ext_len;
+
+public:
+	QuoteView() : quote(NULL), quote_len(0), declared_len(0),
+		datagram_len(0), family(0), ext(NULL), ext_len(0) {}
+	/* Locate the quote in a reply. If the reply is not an ICMP error, the
+	 * view is left empty. */
+	explicit QuoteView(const Packet *reply);
+
+	bool IsQuote() const {
+		return quote != NULL;
+	}
+
+	int GetNetworkProto() const {
+		return family;
+	}
+
+	const byte *GetQuote() const {
+		return quote;
+	}
+
+	size_t GetQuoteSize() const {
+		return quote_len;
+	}
+
+	/* The ICMP did not quote the complete packet */
+	bool IsTruncated() const {
+		return !declared_len || quote_len < declared_len;
+	}
+
+	/* The ICMP extension structure (RFC 4884), either announced by the
+	 * length of the original datagram field or found after its first 128
+	 * bytes as done by older routers. Returns NULL if there is none. */
+	const byte *GetExtensions(size_t *len) const {
+		*len = ext_len;
+		return ext;
+	}
+
+	/* Size of the quoted network header, ignoring IPv6 extension headers.
+	 * Returns 0 if the header has not been quoted. */
+	size_t GetNetworkHeaderSize() const;
+
+	/* IP protocol number of the header following the network one */
+	int GetTransportProto() const;
+
+	/* Size of the quoted TCP or UDP header, 0 if it has not been completely
+	 * quoted or for any other protocol */
+	size_t GetTransportHeaderSize() const;
+
+	/* Locate the options area of the quoted IPv4 (IP::PROTO) or TCP
+	 * (TCP::PROTO) header. area is relative to the start of the header.
+	 * Sets truncated if the quote ends before the end of the header. */
+	bool GetOptionArea(int proto, const byte **area, size_t *len,
+			size_t *hdr_offset, bool *truncated) const;
+
+	/* Build a packet out of the original datagram field, as libcrafter
+	 * would parse it */
+	Packet *Materialize(const struct timeval &ts) const;
+};
+
+/* Locate the options area in a raw TCP or IPv4 header of which only avail
+ * bytes are available. */
+bool GetRawOptionArea(int proto, const byte *hdr, size_t avail,
+		const byte **area, size_t *len, bool *truncated);
+
+#endif
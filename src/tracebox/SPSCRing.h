@@ -0,0 +1,155 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __SPSCRING_H__
+#define __SPSCRING_H__
+
+#include <atomic>
+#include <cstddef>
+
+#define CACHE_LINE_SIZE 64
+
+/* A bounded lock-free queue between exactly one producer thread and one
+ * consumer thread. Each index lives on its own cache line, next to a copy
+ * of the other index that is only refreshed when the ring looks full (or
+ * empty), so that both sides do not keep stealing each other's cache lines.
+ * The tail is only written by the producer, the head by the consumer, save
+ * for push_evict() which lets the producer take the oldest entry away from
+ * the consumer, hence the compare-and-swap in pop(). T must be trivially
+ * copyable, e.g. a pointer. Groups of fields are separated by a full line
+ * of padding rather than aligned with alignas(), as rings are allocated by
+ * new, which does not honor extended alignments before C++17.
+ */
+template <class T>
+class SPSCRing {
+	char pad0[CACHE_LINE_SIZE];
+
+	/* Next slot to read */
+	std::atomic<size_t> head;
+	/* Last value of tail seen by the consumer */
+	size_t tail_cache;
+	char pad1[CACHE_LINE_SIZE];
+
+	/* Next slot to write */
+	std::atomic<size_t> tail;
+	/* Last value of head seen by the producer */
+	size_t head_cache;
+	char pad2[CACHE_LINE_SIZE];
+
+	/* Read-only once built */
+	size_t mask;
+	/* Atomic as a slot may be overwritten while the consumer reads it,
+	 * once push_evict() took it away */
+	std::atomic<T> *slots;
+	char pad3[CACHE_LINE_SIZE];
+
+	SPSCRing(const SPSCRing&) = delete;
+	SPSCRing& operator=(const SPSCRing&) = delete;
+
+public:
+	/* The capacity is rounded up to a power of two */
+	explicit SPSCRing(size_t capacity) : head(0), tail_cache(0), tail(0),
+		head_cache(0)
+	{
+		size_t n = 1;
+
+		while (n < capacity)
+			n <<= 1;
+		mask = n - 1;
+		slots = new std::atomic<T>[n];
+	}
+
+	~SPSCRing()
+	{
+		delete[] slots;
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+
+	/* Producer side, returns false if the ring is full */
+	bool push(const T &v)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+
+		if (t - head_cache > mask) {
+			head_cache = head.load(std::memory_order_acquire);
+			if (t - head_cache > mask)
+				return false;
+		}
+		slots[t & mask].store(v, std::memory_order_relaxed);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Producer side, when the ring is full, discard its oldest entry to
+	 * make room for v. Returns true and sets *old if an entry was
+	 * discarded, which the caller now owns. */
+	bool push_evict(const T &v, T *old)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = t - mask - 1;
+		bool evicted = false;
+
+		if (t - head_cache > mask) {
+			head_cache = head.load(std::memory_order_acquire);
+			if (t - head_cache > mask) {
+				/* Unless the consumer popped it in the meantime */
+				if (head.compare_exchange_strong(h, h + 1,
+							std::memory_order_acq_rel,
+							std::memory_order_acquire)) {
+					*old = slots[h & mask].load(
+							std::memory_order_relaxed);
+					evicted = true;
+					++h;
+				}
+				/* Either way, h is now the head */
+				head_cache = h;
+			}
+		}
+		slots[t & mask].store(v, std::memory_order_relaxed);
+		tail.store(t + 1, std::memory_order_release);
+		return evicted;
+	}
+
+	/* Consumer side, returns false if the ring is empty */
+	bool pop(T *v)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+
+		do {
+			/* The producer may have moved the head past our copy of
+			 * the tail */
+			if ((ptrdiff_t)(tail_cache - h) <= 0) {
+				tail_cache = tail.load(std::memory_order_acquire);
+				if (h == tail_cache)
+					return false;
+			}
+			*v = slots[h & mask].load(std::memory_order_relaxed);
+			/* Fails if push_evict() took the entry in the meantime */
+		} while (!head.compare_exchange_weak(h, h + 1,
+					std::memory_order_release,
+					std::memory_order_relaxed));
+		return true;
+	}
+
+	/* Approximate when called concurrently with push() or pop() */
+	size_t size() const
+	{
+		return tail.load(std::memory_order_acquire) -
+			head.load(std::memory_order_acquire);
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+};
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __TIMESTAMP_H__
+#define __TIMESTAMP_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define NSEC_PER_SEC	1000000000LL
+#define NSEC_PER_USEC	1000LL
+#define NSEC_PER_MSEC	1000000LL
+
+static inline int64_t ts_ns(const struct timeval &tv)
+{
+	return tv.tv_sec * NSEC_PER_SEC + tv.tv_usec * NSEC_PER_USEC;
+}
+
+static inline int64_t ts_ns(const struct timespec &ts)
+{
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline struct timeval ns_timeval(int64_t ns)
+{
+	struct timeval tv;
+
+	tv.tv_sec = ns / NSEC_PER_SEC;
+	tv.tv_usec = (ns % NSEC_PER_SEC) / NSEC_PER_USEC;
+	return tv;
+}
+
+/* Unaffected by the changes of the wall clock, to measure delays */
+static inline int64_t monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(ts);
+}
+
+static inline int64_t realtime_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts_ns(ts);
+}
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include "config.h"
+#include "TraceSession.h"
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <sys/time.h>
+
+using namespace Crafter;
+using namespace std;
+
+TraceSession::TraceSession() : save_d(NULL), save_dumper(NULL), pd(NULL),
+	rd(NULL), pdumper(NULL), recorder(NULL), hops_min(DEFAULT_HOPS_MIN),
+	hops_max(DEFAULT_HOPS_MAX), resolve(true), verbose(false), timeout(1)
+{
+}
+
+TraceSession::~TraceSession()
+{
+	ClosePcap();
+	if (pdumper)
+		pcap_dump_close(pdumper);
+	if (pd)
+		pcap_close(pd);
+	if (rd)
+		pcap_close(rd);
+}
+
+int TraceSession::SetTTLRange(uint8_t ttl_min, uint8_t ttl_max)
+{
+	if(!(ttl_min > 0 && (ttl_min <= ttl_max)))
+		return -1;
+
+	hops_min = ttl_min;
+	hops_max = ttl_max;
+	return 0;
+}
+
+int TraceSession::OpenPcap(const string &filename)
+{
+	OpenPcapDumper(DLT_RAW, filename, save_d, save_dumper);
+	if(save_dumper == NULL){
+		cerr << "Error while opening pcap file : " << pcap_geterr(save_d) << endl;
+		return -1;
+	}
+	return 0;
+}
+
+void TraceSession::WritePcap(Packet *p)
+{
+	if (recorder)
+		return recorder->WritePcap(p);
+
+	lock_guard<mutex> guard(save_lock);
+	struct pcap_pkthdr hdr;
+
+	if (!save_dumper)
+		return;
+	hdr.len = p->GetSize();
+	hdr.caplen = p->GetSize();
+	hdr.ts = p->GetTimestamp();
+	pcap_dump(reinterpret_cast<u_char*>(save_dumper), &hdr, p->GetRawPtr());
+}
+
+void TraceSession::ClosePcap()
+{
+	lock_guard<mutex> guard(save_lock);
+
+	if (!save_dumper)
+		return;
+	pcap_dump_flush(save_dumper);
+	pcap_close(save_d);
+	pcap_dump_close(save_dumper);
+	save_d = NULL;
+	save_dumper = NULL;
+}
+
+ModificationPatterns &TraceSession::GetPatterns()
+{
+	return recorder ? recorder->patterns : patterns;
+}
+
+TraceSession *TraceSession::Fork()
+{
+	TraceSession *s = new TraceSession();
+
+	s->recorder = recorder ? recorder : this;
+	s->hops_min = hops_min;
+	s->hops_max = hops_max;
+	s->destination = destination;
+	s->iface = iface;
+	s->resolve = resolve;
+	s->verbose = verbose;
+	s->timeout = timeout;
+	return s;
+}
+
+bool TraceSession::IsPcap(const string& iface)
+{
+	return iface.compare(0, 5, "pcap:") == 0;
+}
+
+static bool pcapParse(const string& name, string& output, string& input)
+{
+	string s = name;
+	string delimiter = ":";
+	vector<string> tokens;
+	size_t pos = 0;
+
+	while ((pos = s.find(delimiter)) != string::npos) {
+	    string token = s.substr(0, pos);
+	    s.erase(0, pos + 1);
+		tokens.push_back(token);
+	}
+	tokens.push_back(s);
+
+	if (tokens.size() != 3 || tokens[0] != "pcap")
+		return false;
+
+	output = tokens[1];
+	input = tokens[2];
+
+	return true;
+}
+
+Packet* TraceSession::PcapSendRecv(Packet *probe, const string& iface)
+{
+	struct pcap_pkthdr hdr1, hdr2;
+	uint8_t *packet;
+	Packet* reply = NULL;
+	string in_file, out_file;
+
+	if (!pd && !rd)
+		pcapParse(iface, out_file, in_file);
+
+	memset(&hdr1, 0, sizeof(hdr2));
+	if (gettimeofday(&hdr2.ts, NULL) < 0)
+		return NULL;
+	hdr2.len = probe->GetSize();
+	hdr2.caplen = probe->GetSize();
+
+	/* Write packet to pcap and wait for reply */
+	if (!pd)
+		OpenPcapDumper(DLT_RAW, out_file, pd, pdumper);
+
+#ifdef __APPLE__
+	/* if MAC OSX -> IP total len must be changed */
+	byte copy[probe->GetSize()];
+	memcpy(copy, probe->GetRawPtr(), probe->GetSize());
+
+	if (probe->GetLayer<IPLayer>()->GetID() == IP::PROTO) {
+		byte tmp = copy[2];
+		copy[2] = copy[3];
+		copy[3] = tmp;
+	}
+	DumperPcap(pdumper, &hdr2, copy);
+#else
+	DumperPcap(pdumper, &hdr2, probe->GetRawPtr());
+#endif
+	pcap_dump_flush(pdumper);
+	if (!rd) {
+		char pcap_errbuf[PCAP_ERRBUF_SIZE];
+
+		rd = pcap_open_offline(in_file.c_str(), pcap_errbuf);
+		if (rd == NULL) {
+			goto error;
+		}
+
+		if (pcap_get_selectable_fd(rd) < 0) {
+			goto error;
+		}
+	}
+
+	/* Retrieve the reply from MB or server*/
+	if (!(packet = (uint8_t *)pcap_next(rd, &hdr1)))
+		goto error;
+
+	reply = new Packet;
+	switch((packet[0] & 0xf0) >> 4) {
+	case 4:
+		reply->PacketFromIP(packet, hdr1.len);
+		break;
+	case 6:
+		reply->PacketFromIPv6(packet, hdr1.len);
+		break;
+	default:
+		delete reply;
+		return NULL;
+	}
+
+error:
+	return reply;
+}
+
+Packet* TraceSession::SendRecv(Packet *probe, const string &iface,
+		double timeout, int retry)
+{
+	Packet *rcv;
+
+	/* The replayed packets are already in the pcap files */
+	if (IsPcap(iface))
+		return PcapSendRecv(probe, iface);
+
+	rcv = probe->SendRecv(iface, timeout, retry);
+	WritePcap(probe);
+	if (rcv) {
+		Packet p;
+		/* Removing Ethernet Layer for storage */
+		p = rcv->SubPacket(1,rcv->GetLayerCount());
+		WritePcap(&p);
+	}
+	return rcv;
+}
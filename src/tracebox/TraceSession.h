@@ -0,0 +1,101 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __TRACESESSION_H__
+#define __TRACESESSION_H__
+
+#include <mutex>
+#include <string>
+#include <stdint.h>
+
+#include "crafter.h"
+#include "PacketModification.h"
+
+extern "C" {
+#include <pcap.h>
+};
+
+#define DEFAULT_HOPS_MIN 1
+#define DEFAULT_HOPS_MAX 64
+
+/* Everything a trace depends on: its configuration, how the probes are
+ * sent, and the pcap file recording them. A session runs a single trace at
+ * a time, and is used by a single thread: any session handed to another
+ * thread must be a Fork(). Forks only share the pcap file and the
+ * ModificationPatterns of the session they were forked from, which can be
+ * used from any thread through WritePcap() and GetPatterns(). Everything
+ * else, e.g. the TTL range or the replay handles, belongs to one thread.
+ */
+class TraceSession {
+	/* Recording of the probes and of their replies */
+	pcap_t *save_d;
+	pcap_dumper_t *save_dumper;
+	std::mutex save_lock;
+	/* Replay backend, see iface */
+	pcap_t *pd;
+	pcap_t *rd;
+	pcap_dumper_t *pdumper;
+	/* The session recording the packets instead, see Fork() */
+	TraceSession *recorder;
+	/* Shared with the forks as well */
+	ModificationPatterns patterns;
+
+	TraceSession(const TraceSession&) = delete;
+	TraceSession& operator=(const TraceSession&) = delete;
+
+	Crafter::Packet *PcapSendRecv(Crafter::Packet *probe,
+			const std::string &iface);
+
+public:
+	/* TTL of the first and of the last probe */
+	uint8_t hops_min;
+	uint8_t hops_max;
+	/* Name of the destination, resolved for the probes lacking a
+	 * destination address */
+	std::string destination;
+	/* Interface of the probes, the one of the route to the destination if
+	 * empty. pcap:<output>:<input> writes the probes to the output file
+	 * and reads their replies from the input one instead. */
+	std::string iface;
+	/* Print the names of the routers */
+	bool resolve;
+	/* Print the details of the modifications */
+	bool verbose;
+	/* Time to wait for each reply, in seconds */
+	double timeout;
+
+	TraceSession();
+	~TraceSession();
+
+	/* Returns -1 if the range is empty or starts at 0 */
+	int SetTTLRange(uint8_t ttl_min, uint8_t ttl_max);
+
+	/* Record the packets sent and received in filename. Returns -1 if
+	 * it cannot be opened. */
+	int OpenPcap(const std::string &filename);
+	/* Does nothing unless OpenPcap() succeeded */
+	void WritePcap(Crafter::Packet *p);
+	void ClosePcap();
+
+	/* The patterns of the modifications seen by the session and by its
+	 * forks */
+	ModificationPatterns &GetPatterns();
+
+	/* Send the probe through iface and wait for its reply, recording
+	 * both of them. Returns NULL on timeout. */
+	Crafter::Packet *SendRecv(Crafter::Packet *probe, const std::string &iface,
+			double timeout, int retry);
+
+	/* A new session with the same configuration, whose packets are
+	 * recorded by this one, which must outlive it. It cannot replay a
+	 * pcap file. */
+	TraceSession *Fork();
+
+	static bool IsPcap(const std::string &iface);
+};
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_LIBJSON
+#include <json/json.h>
+#endif
+#ifdef HAVE_JSONC
+#include <json-c/json.h>
+#endif
+
+#include "TraceWriter.h"
+#include "Timestamp.h"
+
+using namespace Crafter;
+using namespace std;
+
+TraceWriter::TraceWriter(const TraceSession &s, Format format, ostream &out)
+	: session(s), format(format), out(out), jobj(NULL), hops(NULL),
+	pattern_list(NULL)
+{
+	if (format == JSON) {
+		jobj = json_object_new_object();
+		hops = json_object_new_array();
+		pattern_list = json_object_new_array();
+	}
+}
+
+TraceWriter::~TraceWriter()
+{
+	/* Unless Finish() took them */
+	if (hops)
+		json_object_put(hops);
+	if (pattern_list)
+		json_object_put(pattern_list);
+	if (jobj)
+		json_object_put(jobj);
+}
+
+int TraceWriter::Callback(void *ctx, uint8_t ttl, string &router,
+		PacketModifications *mod)
+{
+	return static_cast<TraceWriter *>(ctx)->Hop(ttl, router, mod);
+}
+
+int TraceWriter::Hop(uint8_t ttl, string &router, PacketModifications *mod)
+{
+	if (format == JSON)
+		Json(ttl, router, mod);
+	else
+		Text(ttl, router, mod);
+	delete mod;
+	return 0;
+}
+
+void TraceWriter::Text(uint8_t ttl, string& router, PacketModifications *mod)
+{
+	const Packet *probe = mod->orig.get();
+	const Packet *rcv = mod->reply.get();
+	IPLayer *ip = probe->GetLayer<IPLayer>();
+
+	if (ttl == 1)
+		out << "tracebox to " <<
+			ip->GetDestinationIP() << " (" << session.destination << "): " <<
+			(int)session.hops_max << " hops max" << endl;
+
+	if (rcv) {
+		if (!session.resolve)
+			out << +(int)ttl << ": " << router << " ";
+		else
+			out << (int)ttl << ": " << GetHostname(router) << " (" << router << ") ";
+		out << mod->rtt / NSEC_PER_MSEC << "ms ";
+		mod->Print(out, session.verbose);
+		out << endl;
+	} else
+		out << (int)ttl << ": *" << endl;
+}
+
+void TraceWriter::Json(uint8_t ttl, string& router, PacketModifications *mod)
+{
+	const Packet *probe = mod->orig.get();
+	IPLayer *ip = probe->GetLayer<IPLayer>();
+
+	if (ttl == 1){
+		json_object_object_add(jobj,"addr", json_object_new_string(ip->GetDestinationIP().c_str()));
+		json_object_object_add(jobj,"name", json_object_new_string(session.destination.c_str()));
+		json_object_object_add(jobj,"max_hops", json_object_new_int(session.hops_max));
+	}
+
+	json_object * hop = json_object_new_object();
+
+	const Packet *rcv = mod->reply.get();
+	if (rcv) {
+		json_object *modif = json_object_new_array();
+		json_object *add = json_object_new_array();
+		json_object *del = json_object_new_array();
+		json_object *ext = NULL;
+		bool added = true;
+		uint32_t id = 0;
+
+		json_object_object_add(hop,"hop", json_object_new_int(ttl));
+		json_object_object_add(hop,"from", json_object_new_string(router.c_str()));
+		json_object_object_add(hop,"delay", json_object_new_int(mod->rtt / NSEC_PER_USEC));
+		if (session.resolve)
+			json_object_object_add(hop,"name", json_object_new_string(GetHostname(router).c_str()));
+
+		/* The values of the fields differ from hop to hop */
+		if (!session.verbose)
+			id = patterns.Intern(mod->GetFingerprint(), &added);
+		if (added) {
+			for (const Modification *m : *mod)
+				m->Print_JSON(modif, add, del, session.verbose);
+		}
+		if (mod->extensions.size() > 0) {
+			ext = json_object_new_array();
+			mod->extensions.Print_JSON(ext, session.verbose);
+		}
+
+		if (session.verbose) {
+			json_object_object_add(hop,"Modifications", modif);
+			json_object_object_add(hop,"Additions", add);
+			json_object_object_add(hop,"Deletions", del);
+		} else {
+			json_object_object_add(hop, "Pattern", json_object_new_int(id));
+			if (added) {
+				json_object *pattern = json_object_new_object();
+
+				json_object_object_add(pattern, "Modifications", modif);
+				json_object_object_add(pattern, "Additions", add);
+				json_object_object_add(pattern, "Deletions", del);
+				json_object_array_add(pattern_list, pattern);
+			} else {
+				json_object_put(modif);
+				json_object_put(add);
+				json_object_put(del);
+			}
+		}
+		if (ext != NULL)
+			json_object_object_add(hop, "ICMPExtensions", ext);
+	}
+	else{
+		json_object_object_add(hop,"hop", json_object_new_int(ttl));
+		json_object_object_add(hop,"from", json_object_new_string("*"));
+	}
+
+	json_object_array_add(hops,hop);
+}
+
+void TraceWriter::Finish()
+{
+	if (format != JSON || !jobj)
+		return;
+
+	json_object_object_add(jobj,"Hops", hops);
+	if (!session.verbose)
+		json_object_object_add(jobj, "Patterns", pattern_list);
+	else
+		json_object_put(pattern_list);
+	out << json_object_to_json_string(jobj) << std::endl;
+	/* Owned by jobj now */
+	hops = NULL;
+	pattern_list = NULL;
+	json_object_put(jobj);
+	jobj = NULL;
+}
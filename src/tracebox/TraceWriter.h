@@ -0,0 +1,61 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __TRACEWRITER_H__
+#define __TRACEWRITER_H__
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+#include "PacketModification.h"
+#include "TraceSession.h"
+
+/* Reports the hops of a trace as the tracebox command does, given as the
+ * context of Callback() to doTracebox() */
+class TraceWriter {
+public:
+	enum Format {
+		/* A line per hop, written as soon as the hop is known */
+		TEXT,
+		/* A single document, written by Finish(). Unless verbose, each
+		 * hop only refers to its set of modifications, listed once. */
+		JSON,
+	};
+
+private:
+	const TraceSession &session;
+	Format format;
+	std::ostream &out;
+	json_object *jobj;
+	json_object *hops;
+	/* The sets of modifications of the hops, by pattern ID */
+	ModificationPatterns patterns;
+	json_object *pattern_list;
+
+	TraceWriter(const TraceWriter&) = delete;
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	void Text(uint8_t ttl, std::string &router, PacketModifications *mod);
+	void Json(uint8_t ttl, std::string &router, PacketModifications *mod);
+
+public:
+	TraceWriter(const TraceSession &s, Format format,
+			std::ostream &out = std::cout);
+	~TraceWriter();
+
+	/* Report a hop, and release mod */
+	int Hop(uint8_t ttl, std::string &router, PacketModifications *mod);
+	/* Once the trace is over */
+	void Finish();
+
+	/* A tracebox_cb_t, whose context is a TraceWriter */
+	static int Callback(void *ctx, uint8_t ttl, std::string &router,
+			PacketModifications *mod);
+};
+
+#endif
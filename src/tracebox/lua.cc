@@ -8,6 +8,7 @@
 
 #include "lua/lua_packet.hpp"
 #include "config.h"
+#include "script.h"
 
 extern lua_State* l_init();
 
@@ -45,11 +46,12 @@ static void _add_argv(lua_State *l, int argc, char **argv)
 	lua_setglobal(l, "argv");
 }
 
-int script_exec(const char *script, int argc, char **argv)
+int script_exec(TraceSession *s, const char *script, int argc, char **argv)
 {
 	int ret;
 
 	lua_State *l = l_init();
+	l_set_session(l, s);
 	_add_argv(l, argc, argv);
 	ret = luaL_dostring(l, script);
 	if (ret)
@@ -59,11 +61,13 @@ int script_exec(const char *script, int argc, char **argv)
 	return ret;
 }
 
-int script_execfile(const char *filename, int argc, char **argv)
+int script_execfile(TraceSession *s, const char *filename, int argc,
+		char **argv)
 {
 	int ret;
 
 	lua_State *l = l_init();
+	l_set_session(l, s);
 	_add_argv(l, argc, argv);
 	lua_pushcfunction(l, lua_traceback);
 	int err_handler = lua_gettop(l);
@@ -154,3 +154,20 @@ bool v_arg_double_opt(lua_State *L, int argt, const char *field, double *val)
 	return true;
 
 }
+
+bool v_arg_function_opt(lua_State *L, int argt, const char *field, int *ref)
+{
+	if(!v_arg(L, argt, field))
+		return false;
+
+	/* The name of a global function */
+	if(lua_type(L, -1) == LUA_TSTRING)
+		lua_getglobal(L, lua_tostring(L, -1));
+	if(lua_type(L, -1) != LUA_TFUNCTION) {
+		const char* msg = lua_pushfstring(L, "%s is not a function", field);
+		luaL_argerror(L, argt, msg);
+	}
+
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return true;
+}
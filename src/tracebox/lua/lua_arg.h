@@ -30,4 +30,8 @@ double v_arg_double(lua_State *L, int argt, const char *field);
 
 bool v_arg_double_opt(lua_State *L, int argt, const char *field, double *val);
 
+/* The field is a function, or the name of a global one, whose reference in
+ * the registry must be released by the caller */
+bool v_arg_function_opt(lua_State *L, int argt, const char *field, int *ref);
+
 #endif
@@ -0,0 +1,443 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "lua_async.h"
+
+#define DEFAULT_ASYNC_THREADS 64
+
+/* A coroutine started by async() */
+struct l_async_co {
+	/* Keeps it alive */
+	int ref;
+	/* The call it waits for, if any. It only runs once the coroutine
+	 * yielded, otherwise it is left over by a failed yield. */
+	l_async_job *job;
+};
+
+/* An event for the state running the coroutines */
+struct l_async_event {
+	l_async_job *job;
+	/* Set once the job can give its results, otherwise the job waits
+	 * in post() for handled to be set */
+	bool done;
+	bool *handled;
+};
+
+/* The coroutines of a state and the pool of threads running their calls */
+struct l_async_loop {
+	std::mutex lock;
+	/* Wakes the state up, for the events */
+	std::condition_variable cond;
+	/* Wakes the jobs in post() up */
+	std::condition_variable handled;
+	/* Wakes the threads of the pool up */
+	std::condition_variable work;
+	std::deque<l_async_job *> pending;
+	std::deque<l_async_event> events;
+	std::vector<std::thread> threads;
+	size_t idle;
+	size_t max_threads;
+	bool quit;
+
+	/* Only used by the state */
+	std::map<lua_State *, l_async_co> coroutines;
+	/* Coroutines that yielded by themselves, to be resumed */
+	std::deque<lua_State *> ready;
+
+	l_async_loop() : idle(0), max_threads(DEFAULT_ASYNC_THREADS),
+		quit(false) {}
+
+	~l_async_loop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+			for (l_async_job *job : pending)
+				delete job;
+			pending.clear();
+			work.notify_all();
+			handled.notify_all();
+		}
+		for (std::thread &t : threads)
+			t.join();
+		for (const l_async_event &ev : events)
+			if (ev.done)
+				delete ev.job;
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		for (;;) {
+			++idle;
+			work.wait(guard, [this] { return quit || !pending.empty(); });
+			--idle;
+			if (quit)
+				return;
+			l_async_job *job = pending.front();
+			pending.pop_front();
+			guard.unlock();
+
+			job->run();
+
+			guard.lock();
+			if (quit) {
+				delete job;
+				return;
+			}
+			events.push_back({job, true, NULL});
+			cond.notify_one();
+		}
+	}
+
+	void submit(l_async_job *job)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		job->loop = this;
+		pending.push_back(job);
+		if (idle < pending.size() && threads.size() < max_threads)
+			threads.push_back(std::thread(&l_async_loop::worker, this));
+		work.notify_one();
+	}
+
+	/* Wait for the next job that is over, handling the events of the
+	 * others in l meanwhile */
+	l_async_job *next(lua_State *l)
+	{
+		for (;;) {
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait(guard, [this] { return !events.empty(); });
+			l_async_event ev = events.front();
+			events.pop_front();
+			guard.unlock();
+
+			if (ev.done)
+				return ev.job;
+			ev.job->notify(l);
+			guard.lock();
+			*ev.handled = true;
+			handled.notify_all();
+		}
+	}
+};
+
+bool l_async_job::post()
+{
+	std::unique_lock<std::mutex> guard(loop->lock);
+	bool done = false;
+
+	if (loop->quit)
+		return false;
+	loop->events.push_back({this, false, &done});
+	loop->cond.notify_one();
+	loop->handled.wait(guard, [this, &done] { return done || loop->quit; });
+	return done;
+}
+
+/* Its address is the key of the loop in the registry */
+static const char l_async_key = 0;
+
+static int l_async_gc(lua_State *l)
+{
+	delete *static_cast<l_async_loop **>(lua_touserdata(l, 1));
+	return 0;
+}
+
+static l_async_loop *l_get_loop(lua_State *l, bool create = true)
+{
+	l_async_loop *loop, **owned;
+
+	lua_pushlightuserdata(l, (void *)&l_async_key);
+	lua_rawget(l, LUA_REGISTRYINDEX);
+	if (lua_isuserdata(l, -1) || !create) {
+		loop = lua_isuserdata(l, -1) ?
+			*static_cast<l_async_loop **>(lua_touserdata(l, -1)) : NULL;
+		lua_pop(l, 1);
+		return loop;
+	}
+	lua_pop(l, 1);
+
+	/* The jobs use the session, which must thus be collected last */
+	l_get_session(l);
+	loop = new l_async_loop();
+	lua_pushlightuserdata(l, (void *)&l_async_key);
+	owned = static_cast<l_async_loop **>(lua_newuserdata(l, sizeof(loop)));
+	*owned = loop;
+	lua_newtable(l);
+	lua_pushcfunction(l, l_async_gc);
+	lua_setfield(l, -2, "__gc");
+	lua_setmetatable(l, -2);
+	lua_rawset(l, LUA_REGISTRYINDEX);
+	return loop;
+}
+
+/* Whether the C function running in l can yield */
+static bool l_can_yield(lua_State *l)
+{
+#if LUA_VERSION_NUM >= 503
+	return lua_isyieldable(l);
+#else
+	lua_Debug ar;
+
+	/* Any C function in between, e.g. pcall() or table.sort(), or a
+	 * metamethod or an iterator called by the VM, prevents it */
+	for (int level = 1; lua_getstack(l, level, &ar); ++level) {
+		if (!lua_getinfo(l, "Sn", &ar) || !strcmp(ar.what, "C"))
+			return false;
+		if (ar.namewhat && (!strcmp(ar.namewhat, "metamethod") ||
+					!strcmp(ar.namewhat, "for iterator")))
+			return false;
+	}
+	return true;
+#endif
+}
+
+bool l_async_running(lua_State *l)
+{
+	l_async_loop *loop = l_get_loop(l, false);
+
+	return loop && loop->coroutines.count(l) && l_can_yield(l);
+}
+
+/* Drop the job left over by a failed yield of the coroutine c */
+static void l_async_discard(lua_State *l, l_async_co &c)
+{
+	if (!c.job)
+		return;
+	c.job->discard(l);
+	delete c.job;
+	c.job = NULL;
+}
+
+int l_async_call(lua_State *l, l_async_job *job)
+{
+	l_async_co &c = l_get_loop(l)->coroutines[l];
+
+	l_async_discard(l, c);
+	c.job = job;
+	/* Tells l_async_resume() that the yield is ours, the job only
+	 * starts then */
+	lua_pushlightuserdata(l, (void *)&l_async_key);
+	return lua_yield(l, 1);
+}
+
+/* Returns the status, and the number of values yielded in nres */
+static int l_resume(lua_State *co, lua_State *from, int narg, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+	return lua_resume(co, from, narg, nres);
+#elif LUA_VERSION_NUM >= 502
+	int ret = lua_resume(co, from, narg);
+	*nres = lua_gettop(co);
+	return ret;
+#else
+	int ret = lua_resume(co, narg);
+	(void)from;
+	*nres = lua_gettop(co);
+	return ret;
+#endif
+}
+
+/* Resume co with the narg values on its stack, until it waits for a job,
+ * yields or is over */
+static void l_async_resume(lua_State *l, l_async_loop *loop, lua_State *co,
+		int narg)
+{
+	int nres, ret = l_resume(co, l, narg, &nres);
+	l_async_co &c = loop->coroutines[co];
+
+	if (ret == LUA_YIELD) {
+		bool call = nres == 1 &&
+			lua_touserdata(co, -1) == (void *)&l_async_key;
+
+		lua_pop(co, nres);
+		if (call) {
+			loop->submit(c.job);
+			return;
+		}
+		/* coroutine.yield(), let the others go on */
+		l_async_discard(l, c);
+		loop->ready.push_back(co);
+		return;
+	}
+	if (ret) {
+		lua_getglobal(l, "debug");
+		lua_getfield(l, -1, "traceback");
+		lua_rawgeti(l, LUA_REGISTRYINDEX, c.ref);
+		lua_xmove(co, l, 1);
+		if (lua_pcall(l, 2, 1, 0) == 0)
+			std::cerr << "Error in an async function: " <<
+				lua_tostring(l, -1) << std::endl;
+		lua_pop(l, 2);
+	}
+	l_async_discard(l, c);
+	luaL_unref(l, LUA_REGISTRYINDEX, c.ref);
+	loop->coroutines.erase(co);
+}
+
+/***
+ * @module Globals
+ */
+
+/***
+ * Call fn(...) in a new coroutine, until it calls @{tracebox} or
+ * @{Packet:sendrecv}, or yields. These calls then run in the background,
+ * and @{run_async} resumes the coroutine with their results once they are
+ * over, so that many traces can be in flight at once while each function
+ * reads sequentially. The callbacks of the traces are called by
+ * @{run_async}, in between the coroutines. The calls block instead, as
+ * outside of the coroutines, when replaying a pcap file or when they
+ * cannot yield, e.g. from within a pcall on Lua 5.1 or a table.sort
+ * comparator. On Lua 5.1 and 5.2, metamethods written in Lua are not
+ * always detected, and the call then raises an error.
+ * Each call in flight holds a thread of its own, which opens its own
+ * capture, until it is over. At most @{set_async_threads} calls thus run
+ * at once, the others waiting for a thread to be free.
+ * @function async
+ * @tparam function fn the function to call
+ * @param ... its arguments
+ * @see run_async
+ * @usage for _, dst in ipairs(servers) do
+ * 	async(function(d)
+ * 		if tracebox(ip{dst=d} / tcp{dst=21}) then print(d .. " replied") end
+ * 	end, dst)
+ * end
+ * run_async()
+ */
+int l_async(lua_State *l)
+{
+	l_async_loop *loop = l_get_loop(l);
+	int narg = lua_gettop(l) - 1;
+	lua_State *co;
+
+	luaL_checktype(l, 1, LUA_TFUNCTION);
+	co = lua_newthread(l);
+	loop->coroutines[co] = { luaL_ref(l, LUA_REGISTRYINDEX), NULL };
+	lua_xmove(l, co, narg + 1);
+	l_async_resume(l, loop, co, narg);
+	return 0;
+}
+
+/***
+ * Run the coroutines started by @{async}, and the callbacks of their
+ * traces, until they are all over. Their errors are printed.
+ * @function run_async
+ * @see async
+ */
+int l_run_async(lua_State *l)
+{
+	l_async_loop *loop = l_get_loop(l);
+
+	if (loop->coroutines.count(l))
+		return luaL_error(l, "run_async() cannot be called from an async "
+				"function");
+
+	while (!loop->coroutines.empty()) {
+		if (!loop->ready.empty()) {
+			lua_State *co = loop->ready.front();
+
+			loop->ready.pop_front();
+			l_async_resume(l, loop, co, 0);
+			continue;
+		}
+
+		l_async_job *job = loop->next(l);
+		for (auto &c : loop->coroutines) {
+			if (c.second.job != job)
+				continue;
+			lua_State *co = c.first;
+			int n = job->results(co);
+
+			c.second.job = NULL;
+			delete job;
+			l_async_resume(l, loop, co, n);
+			break;
+		}
+	}
+	return 0;
+}
+
+/***
+ * Set the number of calls of the @{async} functions that can run at once.
+ * Each of them blocks a thread, with its own capture, for as long as it
+ * runs, so this bounds how many traces are in flight.
+ * @function set_async_threads
+ * @tparam num n the number of threads running them
+ * @treturn num the previous number
+ */
+int l_set_async_threads(lua_State *l)
+{
+	l_async_loop *loop = l_get_loop(l);
+	int n = luaL_checkinteger(l, 1);
+
+	if (n < 1)
+		return luaL_argerror(l, 1, "There must be at least one thread");
+	std::lock_guard<std::mutex> guard(loop->lock);
+	lua_pushinteger(l, loop->max_threads);
+	loop->max_threads = n;
+	return 1;
+}
+
+void l_async_run_all(lua_State *l, const std::vector<l_async_job *> &jobs,
+		size_t threads, int t, int cb)
+{
+	l_async_loop loop;
+	std::map<l_async_job *, size_t> index;
+	int err_handler;
+
+	if (!threads) {
+		l_async_loop *shared = l_get_loop(l);
+		std::lock_guard<std::mutex> guard(shared->lock);
+		threads = shared->max_threads;
+	}
+	loop.max_threads = threads;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		index[jobs[i]] = i + 1;
+		loop.submit(jobs[i]);
+	}
+
+	lua_pushcfunction(l, lua_traceback);
+	err_handler = lua_gettop(l);
+	for (size_t n = 0; n < jobs.size(); ++n) {
+		l_async_job *job = loop.next(l);
+		int top = lua_gettop(l);
+		int nres = job->results(l);
+		size_t i = index[job];
+
+		delete job;
+		if (cb) {
+			lua_pushvalue(l, cb);
+			lua_insert(l, top + 1);
+			lua_pushinteger(l, i);
+			lua_insert(l, top + 2);
+			if (lua_pcall(l, nres + 1, 0, err_handler)) {
+				std::cerr << "Error in the callback: " <<
+					lua_tostring(l, -1) << std::endl;
+				lua_pop(l, 1);
+			}
+			continue;
+		}
+		if (nres && !lua_isnil(l, top + 1))
+			lua_pushvalue(l, top + 1);
+		else
+			lua_pushboolean(l, 0);
+		lua_rawseti(l, t, i);
+		lua_settop(l, top);
+	}
+	lua_pop(l, 1);
+}
@@ -0,0 +1,60 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+#ifndef __LUA_ASYNC_H_
+#define __LUA_ASYNC_H_
+
+#include <vector>
+
+#include "lua_base.hpp"
+
+struct l_async_loop;
+
+/* A blocking call of a coroutine started by async(), or of a batch, run in
+ * a thread of a pool while the state goes on */
+struct l_async_job {
+	l_async_job() : loop(NULL) {}
+	virtual ~l_async_job() {}
+
+	/* In a thread of the pool */
+	virtual void run() = 0;
+	/* In the state running the jobs, for each post() */
+	virtual void notify(lua_State *) {}
+	/* In the state running the jobs, once run() returned: push the
+	 * results of the call on the stack of co, the coroutine or the state,
+	 * and return their number */
+	virtual int results(lua_State *co) = 0;
+	/* In the state, instead of results(), if the job never ran */
+	virtual void discard(lua_State *) {}
+
+protected:
+	/* From run(), have notify() called and wait for it. Returns false if
+	 * the state is being closed instead. */
+	bool post();
+
+private:
+	friend struct l_async_loop;
+	l_async_loop *loop;
+};
+
+/* Whether l is a coroutine started by async(), whose running C function
+ * can yield */
+extern bool l_async_running(lua_State *l);
+/* Yield l and run the job, once l yielded. l will be resumed with the
+ * results of the job, which it deletes then. Must be returned by the C
+ * function, after l_async_running() returned true. */
+extern int l_async_call(lua_State *l, l_async_job *job);
+/* Run the jobs at once, at most threads of them at a time, or as many as
+ * set by set_async_threads() if 0, and handle their events in l. The first
+ * result of each job, or false, goes into the table at the index t of l,
+ * in the order of the jobs, unless cb is the index of a function of l, which
+ * is then called with the position of each job and its results as soon as
+ * it is over. Deletes the jobs. */
+extern void l_async_run_all(lua_State *l, const std::vector<l_async_job *> &jobs,
+		size_t threads, int t, int cb);
+
+#endif
@@ -6,6 +6,7 @@
  */
 
 #include "lua_base.hpp"
+#include "../TraceSession.h"
 
 /***
  * Abstract type for all custom classes exposed from cpp,
@@ -97,6 +98,53 @@ lua_CFunction l_data_type<lua_CFunction>::extract(lua_State *l, int n)
 	return lua_tocfunction(l, n);
 }
 
+/* Its address is the key of the session in the registry */
+static const char l_session_key = 0;
+
+static int l_session_gc(lua_State *l)
+{
+	delete *static_cast<TraceSession **>(lua_touserdata(l, 1));
+	return 0;
+}
+
+TraceSession *l_get_session(lua_State *l)
+{
+	TraceSession *s, **owned;
+
+	lua_pushlightuserdata(l, (void *)&l_session_key);
+	lua_rawget(l, LUA_REGISTRYINDEX);
+	if (lua_islightuserdata(l, -1)) {
+		s = static_cast<TraceSession *>(lua_touserdata(l, -1));
+		lua_pop(l, 1);
+		return s;
+	}
+	if (lua_isuserdata(l, -1)) {
+		s = *static_cast<TraceSession **>(lua_touserdata(l, -1));
+		lua_pop(l, 1);
+		return s;
+	}
+	lua_pop(l, 1);
+
+	/* Owned by the state */
+	s = new TraceSession();
+	lua_pushlightuserdata(l, (void *)&l_session_key);
+	owned = static_cast<TraceSession **>(lua_newuserdata(l, sizeof(s)));
+	*owned = s;
+	lua_newtable(l);
+	lua_pushcfunction(l, l_session_gc);
+	lua_setfield(l, -2, "__gc");
+	lua_setmetatable(l, -2);
+	lua_rawset(l, LUA_REGISTRYINDEX);
+	return s;
+}
+
+void l_set_session(lua_State *l, TraceSession *s)
+{
+	lua_pushlightuserdata(l, (void *)&l_session_key);
+	lua_pushlightuserdata(l, s);
+	lua_rawset(l, LUA_REGISTRYINDEX);
+}
+
 int lua_traceback(lua_State *L) {
     lua_getglobal(L, "debug");
     lua_getfield(L, -1, "traceback");
@@ -29,6 +29,14 @@ extern void stackDump (lua_State *L, const char* file, size_t line,
 
 extern void l_do(lua_State *l, const char*);
 
+class TraceSession;
+/* The session of the traces of the state, created along with it unless
+ * one was given to l_set_session() */
+extern TraceSession *l_get_session(lua_State *l);
+/* Use s, which must outlive the state. States running in different threads
+ * cannot share a session, each of them needs its own TraceSession::Fork(). */
+extern void l_set_session(lua_State *l, TraceSession *s);
+
 extern const char *l_classname_field;
 
 /* Wrapper around lua types */
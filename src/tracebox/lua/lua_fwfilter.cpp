@@ -7,22 +7,35 @@
 
 #include "lua_fwfilter.h"
 #include "lua_packet.hpp"
+#include "../NFTables.h"
 #include <sstream>
+#include <netinet/in.h>
 
 using namespace Crafter;
 
+static int IPProto(const char *proto)
+{
+	return strcmp(proto, "tcp") ? IPPROTO_UDP : IPPROTO_TCP;
+}
+
 FWFilter::FWFilter(int src, int dst, const char *proto)
 	: src(src), dst(dst), proto(proto),
 #ifdef __APPLE__
 	id(src^dst),
 #endif
-	closed(false)
+	native(false), closed(false)
 {
 	std::ostringstream ss;
 #ifdef __APPLE__
 	ss << "ipfw add " << StrPort(id) << " deny " << proto << " from any "
 		<< StrPort(dst) << " to any " << StrPort(src) + " in";
 #else /* Assume Linux */
+	NFTRules *nft = NFTRules::Get();
+
+	if (nft && nft->AddFilter(IPProto(proto), dst, src)) {
+		native = true;
+		return;
+	}
 	ss << "iptables -A INPUT -p " << proto << " --sport "
 		<< StrPort(dst) << " --dport " << StrPort(src) << " -j DROP";
 #endif
@@ -33,6 +46,12 @@ void FWFilter::close() {
 	if (closed)
 		return;
 
+	closed = true;
+	if (native) {
+		NFTRules::Get()->RemoveFilter(IPProto(proto), dst, src);
+		return;
+	}
+
 	std::ostringstream ss;
 #ifdef __APPLE__
 	ss << "ipfw del " << StrPort(id);
@@ -41,8 +60,8 @@ void FWFilter::close() {
 		<< StrPort(dst) << " --dport " << StrPort(src) << " -j DROP";
 #endif
 	system(ss.str().c_str());
-	closed = true;
 }
+
 /***
  * A simple firewall rule on the host machine. Create one with @{Globals.filter}
  * @classmod FWFilter
@@ -16,6 +16,8 @@ class FWFilter {
 	int id;
 #endif
 	const char *proto;
+	/* Installed through nftables rather than by a command */
+	bool native;
 	bool closed;
 public:
 	FWFilter(int src, int dst, const char *proto);
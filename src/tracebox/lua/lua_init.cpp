@@ -90,7 +90,14 @@ L_EXPOSE_TYPE(TbxSniffer);
 
 /* lua_tracebox.cpp */
 extern int l_Tracebox(lua_State *l);
+extern int l_tracebox_many(lua_State *l);
 extern int l_set_ttl_range(lua_State *);
+extern int l_set_packet_ring(lua_State *l);
+extern int l_packet_ring(lua_State *l);
+/* lua_async.cpp */
+extern int l_async(lua_State *l);
+extern int l_run_async(lua_State *l);
+extern int l_set_async_threads(lua_State *l);
 /* lua_utils.cpp */
 extern int l_sleep(lua_State *l);
 extern int l_dump_stack(lua_State *l);
@@ -98,6 +105,7 @@ extern int l_dn6(lua_State *l);
 extern int l_dn4(lua_State *l);
 extern int l_gethostname(lua_State *l);
 extern int l_random(lua_State *l);
+extern int l_modification_pattern(lua_State *l);
 
 lua_State *l_init()
 {
@@ -128,6 +136,7 @@ lua_State *l_init()
 	INIT_LAYER(l_partialtcp_ref, PartialTCP, l);
 
 	REGISTER_FUNCTION(l, "tracebox", l_Tracebox);
+	REGISTER_FUNCTION(l, "tracebox_many", l_tracebox_many);
 	REGISTER_FUNCTION(l, "sleep", l_sleep);
 	REGISTER_FUNCTION(l, "dn4", l_dn4);
 	REGISTER_FUNCTION(l, "dn6", l_dn6);
@@ -135,6 +144,12 @@ lua_State *l_init()
 	REGISTER_FUNCTION(l, "__dump_c_stack", l_dump_stack);
 	REGISTER_FUNCTION(l, "random", l_random);
 	REGISTER_FUNCTION(l, "set_ttl_range", l_set_ttl_range);
+	REGISTER_FUNCTION(l, "set_packet_ring", l_set_packet_ring);
+	REGISTER_FUNCTION(l, "packet_ring", l_packet_ring);
+	REGISTER_FUNCTION(l, "modification_pattern", l_modification_pattern);
+	REGISTER_FUNCTION(l, "async", l_async);
+	REGISTER_FUNCTION(l, "run_async", l_run_async);
+	REGISTER_FUNCTION(l, "set_async_threads", l_set_async_threads);
 
 	return l;
 }
@@ -10,6 +10,7 @@
 #include "lua_ip.h"
 #include "lua_ipv6.h"
 #include "lua_arg.h"
+#include "lua_async.h"
 #include "../tracebox.h"
 
 using namespace Crafter;
@@ -62,8 +63,41 @@ static int new_packet(lua_State *l)
 	return p != NULL;
 }
 
+/* A sendrecv run in the background */
+struct l_sendrecv_job : public l_async_job {
+	std::unique_ptr<TraceSession> fork;
+	TraceSession *session;
+	Packet probe;
+	std::string iface;
+	double timeout;
+	int retry;
+	Packet *rcv;
+
+	/* Send through a fork of s if forked is set, otherwise through s,
+	 * which the state must not use meanwhile */
+	l_sendrecv_job(TraceSession *s, bool forked, const Packet &p,
+			const std::string &iface, double timeout, int retry)
+		: fork(forked ? s->Fork() : NULL), session(forked ? fork.get() : s),
+		probe(p), iface(iface), timeout(timeout), retry(retry), rcv(NULL) {}
+
+	void run()
+	{
+		rcv = session->SendRecv(&probe, iface, timeout, retry);
+	}
+
+	int results(lua_State *co)
+	{
+		if (!rcv)
+			lua_pushnil(co);
+		else
+			new l_packet_ref(rcv, co);
+		return 1;
+	}
+};
+
 /***
- * Send a packet and wait for a reply
+ * Send a packet and wait for a reply. In a function started by @{async},
+ * the other functions go on in the meantime.
  * @function sendrecv
  * @tparam[opt] table args A table containing the optional arguments, see @{sendrecv_args}
  * @treturn Packet reply A received packet with the same flow key,
@@ -80,7 +114,8 @@ static int new_packet(lua_State *l)
  */
 int l_packet_ref::send_receive(lua_State *l)
 {
-	double timeout = tbx_default_timeout;
+	TraceSession *s = l_get_session(l);
+	double timeout = s->timeout;
 	int retry = 3;
 	const char *iface = "";
 	v_arg_double_opt(l, 2, "timeout", &timeout);
@@ -89,23 +124,85 @@ int l_packet_ref::send_receive(lua_State *l)
 
 	std::string err, intf(iface);
 	Packet *p = l_packet_ref::extract(l, 1);
-	if (!probe_sanity_check(p, err, intf))
+	if (!probe_sanity_check(*s, p, err, intf))
 		luaL_argerror(l, 1, err.c_str());
-	writePcap(p);
-	Packet *rcv = p->SendRecv(intf, timeout, retry);
+	if (l_async_running(l) && !TraceSession::IsPcap(intf))
+		return l_async_call(l, new l_sendrecv_job(s, true, *p, intf,
+					timeout, retry));
+	Packet *rcv = s->SendRecv(p, intf, timeout, retry);
 	if (!rcv)
 		lua_pushnil(l);
-	else{
-		Packet p;
-		/* Removing Ethernet Layer for storage */
-		p = rcv->SubPacket(1,rcv->GetLayerCount());
-		writePcap(&p);
+	else
 		new l_packet_ref(rcv, l);
-	}
 
 	return 1;
 }
 
+/***
+ * Send all the packets at once and wait for their replies, with at most as
+ * many of them in flight as set by @{set_async_threads}. They are sent one
+ * after the other when replaying a pcap file.
+ * @function sendrecv_many
+ * @tparam table pkts the list of packets
+ * @tparam[opt] table args see @{sendrecv_args}, and @{sendrecv_many_args}
+ * @treturn table the replies, or false, in the order of the packets,
+ * unless there is a result function
+ * @usage replies = Packet.sendrecv_many({ip{dst=a} / UDP, ip{dst=b} / UDP})
+ */
+/***
+ * Additional arguments of sendrecv_many
+ * @table sendrecv_many_args
+ * @tfield function result called with the position of each packet and its
+ * reply, or nil, as soon as it is known, instead of returning them
+ */
+int l_packet_ref::send_receive_many(lua_State *l)
+{
+	TraceSession *s = l_get_session(l);
+	double timeout = s->timeout;
+	int retry = 3, result = 0;
+	const char *iface = "";
+	std::vector<l_async_job *> jobs;
+	std::vector<std::pair<Packet *, std::string> > pkts;
+	bool replay;
+
+	luaL_checktype(l, 1, LUA_TTABLE);
+	if (lua_gettop(l) > 1) {
+		v_arg_double_opt(l, 2, "timeout", &timeout);
+		v_arg_integer_opt(l, 2, "retry", &retry);
+		v_arg_string_opt(l, 2, "interface", &iface);
+		lua_getfield(l, 2, "result");
+		if (lua_isnil(l, -1))
+			lua_pop(l, 1);
+		else if (lua_isfunction(l, -1))
+			result = lua_gettop(l);
+		else
+			return luaL_argerror(l, 2, "result must be a function");
+	}
+	replay = TraceSession::IsPcap(iface);
+
+	for (size_t i = 1; i <= lua_objlen(l, 1); ++i) {
+		std::string err, intf(iface);
+		Packet *p;
+
+		lua_rawgeti(l, 1, i);
+		p = l_packet_ref::extract(l, -1);
+		lua_pop(l, 1);
+		if (!probe_sanity_check(*s, p, err, intf))
+			return luaL_error(l, "Cannot send packet %d: %s", (int)i,
+					err.c_str());
+		pkts.push_back(std::make_pair(p, intf));
+	}
+
+	for (auto &p : pkts)
+		jobs.push_back(new l_sendrecv_job(s, !replay, *p.first, p.second,
+					timeout, retry));
+	if (!result)
+		lua_createtable(l, jobs.size(), 0);
+	l_async_run_all(l, jobs, replay ? 1 : 0, result ? 0 : lua_gettop(l),
+			result);
+	return result ? 0 : 1;
+}
+
 /***
  * Send a packet over the wire
  * @function send
@@ -115,13 +212,14 @@ int l_packet_ref::send_receive(lua_State *l)
 int l_packet_ref::send(lua_State *l)
 {
 	Packet *p = l_packet_ref::extract(l, 1);
+	TraceSession *s = l_get_session(l);
 	std::string iface, err;
 	if (lua_gettop(l) > 1)
 		iface = luaL_checkstring(l, 2);
 
-	if (!probe_sanity_check(p, err, iface))
+	if (!probe_sanity_check(*s, p, err, iface))
 		luaL_argerror(l, 1, err.c_str());
-	writePcap(p);
+	s->WritePcap(p);
 	p->Send(iface);
 	return 0;
 }
@@ -148,7 +246,8 @@ int l_packet_ref::l_bytes(lua_State *l)
 
 /***
  * Get the timestamp associated with this packet:
- * the time at which it was last sent or received)
+ * the time at which it was last sent or received, as set by the kernel for
+ * the packets received by a sniffer
  * @function ts
  * @treturn the timestamp in usec
  */
@@ -156,7 +255,7 @@ int l_packet_ref::l_ts(lua_State *l)
 {
 	Packet *p = l_packet_ref::extract(l, 1);
 	struct timeval ts = p->GetTimestamp();
-	lua_Number x = ts.tv_sec * 10e6L + ts.tv_usec;
+	lua_Number x = ts.tv_sec * 1000000.0 + ts.tv_usec;
 	lua_pushnumber(l, x);
 	return 1;
 }
@@ -235,6 +334,7 @@ void l_packet_ref::register_members(lua_State *l)
 	meta_bind_func(l, "destination", destination);
 	meta_bind_func(l, "send", send);
 	meta_bind_func(l, "sendrecv", send_receive);
+	meta_bind_func(l, "sendrecv_many", send_receive_many);
 	/* Bind all available layers */
 	/***
 	 * Get the IP or IPv6 Layer of this packet
@@ -31,6 +31,7 @@ struct l_packet_ref : public l_crafter_ref<Crafter::Packet> {
 	static int destination(lua_State *l);
 	static int send(lua_State *l);
 	static int send_receive(lua_State *l);
+	static int send_receive_many(lua_State *l);
 	static int iplayer(lua_State *l);
 	static int l_bytes(lua_State *l);
 	static int l_ts(lua_State *l);
@@ -8,6 +8,7 @@
 #include "lua_packetmodifications.h"
 #include "lua_packet.hpp"
 #include "lua_crafter.hpp"
+#include "../TraceSession.h"
 
 using namespace Crafter;
 
@@ -44,14 +45,17 @@ int l_packetmodifications_ref::l_PacketModifications_print(lua_State *l)
 int l_packetmodifications_ref::l_get_original(lua_State *l)
 {
 	PacketModifications *r = l_packetmodifications_ref::extract(l, 1);
-	new l_packet_ref(new Packet(*r->orig), l);
+	if (r->orig)
+		new l_packet_ref(new Packet(*r->orig), l);
+	else
+		lua_pushnil(l);
 	return 1;
 }
 
 int l_packetmodifications_ref::l_get_received(lua_State *l)
 {
 	PacketModifications *r = l_packetmodifications_ref::extract(l, 1);
-	const Packet *rcv = r->modif.get();
+	std::shared_ptr<const Packet> rcv = r->GetReceived();
 	if (rcv)
 		new l_packet_ref(new Packet(*rcv), l);
 	else
@@ -59,6 +63,150 @@ int l_packetmodifications_ref::l_get_received(lua_State *l)
 	return 1;
 }
 
+int l_packetmodifications_ref::l_get_cumulative(lua_State *l)
+{
+	std::shared_ptr<PacketModifications> owner =
+		l_packetmodifications_ref::get_owner<PacketModifications>(l, 1);
+	PacketModifications *r = l_packetmodifications_ref::extract(l, 1);
+	/* The cumulative modifications are owned by the incremental ones */
+	new l_packetmodifications_ref(
+			const_cast<PacketModifications *>(r->GetCumulative()), owner, l);
+	return 1;
+}
+
+static int l_incremental(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	lua_pushboolean(l, p->IsIncremental());
+	return 1;
+}
+
+static void push_extension(lua_State *l, const ICMPExtensionObject &o)
+{
+	MPLSLabel labels[MAX_MPLS_LABELS];
+	InterfaceInfo info;
+	size_t n;
+
+	lua_newtable(l);
+	lua_pushstring(l, ICMPExtensions::GetName(o).c_str());
+	lua_setfield(l, -2, "name");
+	lua_pushinteger(l, o.class_num);
+	lua_setfield(l, -2, "class");
+	lua_pushinteger(l, o.c_type);
+	lua_setfield(l, -2, "ctype");
+
+	if ((n = ICMPExtensions::GetMPLSLabels(o, labels))) {
+		lua_createtable(l, n, 0);
+		for (size_t i = 0; i < n; ++i) {
+			lua_createtable(l, 0, 4);
+			lua_pushinteger(l, labels[i].label);
+			lua_setfield(l, -2, "label");
+			lua_pushinteger(l, labels[i].tc);
+			lua_setfield(l, -2, "tc");
+			lua_pushboolean(l, labels[i].s);
+			lua_setfield(l, -2, "s");
+			lua_pushinteger(l, labels[i].ttl);
+			lua_setfield(l, -2, "ttl");
+			lua_rawseti(l, -2, i + 1);
+		}
+		lua_setfield(l, -2, "labels");
+	} else if (ICMPExtensions::GetInterfaceInfo(o, &info)) {
+		lua_pushstring(l, ICMPExtensions::GetRoleName(info.role));
+		lua_setfield(l, -2, "role");
+		if (info.has_ifindex) {
+			lua_pushnumber(l, info.ifindex);
+			lua_setfield(l, -2, "ifindex");
+		}
+		if (info.addr) {
+			lua_pushstring(l, ICMPExtensions::GetAddress(info).c_str());
+			lua_setfield(l, -2, "addr");
+		}
+		if (info.name) {
+			lua_pushlstring(l, info.name, info.name_len);
+			lua_setfield(l, -2, "name");
+		}
+		if (info.has_mtu) {
+			lua_pushnumber(l, info.mtu);
+			lua_setfield(l, -2, "mtu");
+		}
+	}
+}
+
+static int l_extensions(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	int i = 1;
+
+	lua_createtable(l, p->extensions.size(), 0);
+	for (const ICMPExtensionObject &o : p->extensions) {
+		push_extension(l, o);
+		lua_rawseti(l, -2, i++);
+	}
+	return 1;
+}
+
+static int l_pattern(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	lua_pushinteger(l, l_get_session(l)->GetPatterns().Intern(
+				p->GetFingerprint()));
+	return 1;
+}
+
+static int l_compact(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	p->Compact(luaL_optinteger(l, 2, DEFAULT_QUOTE_SNIPPET_LEN));
+	return 0;
+}
+
+static int l_is_compact(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	lua_pushboolean(l, p->IsCompact());
+	return 1;
+}
+
+static int l_router(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	if (p->router.empty())
+		lua_pushnil(l);
+	else
+		lua_pushstring(l, p->router.c_str());
+	return 1;
+}
+
+static int l_rtt(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	if (p->rtt < 0)
+		lua_pushnil(l);
+	else
+		lua_pushnumber(l, p->rtt);
+	return 1;
+}
+
+static int l_snippet(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	const std::vector<byte> &snippet = p->GetQuoteSnippet();
+
+	lua_createtable(l, snippet.size(), 0);
+	for (size_t i = 0; i < snippet.size(); ++i) {
+		lua_pushinteger(l, snippet[i]);
+		lua_rawseti(l, -2, i + 1);
+	}
+	return 1;
+}
+
+static int l_fingerprint(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	l_data_type<std::string>(p->GetFingerprint()).push(l);
+	return 1;
+}
+
 static int l_partial(lua_State *l)
 {
 	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
@@ -66,6 +214,97 @@ static int l_partial(lua_State *l)
 	return 1;
 }
 
+static int l_has(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	lua_pushboolean(l, p->Has(luaL_checkstring(l, 2)));
+	return 1;
+}
+
+static void push_value(lua_State *l, const std::string &v)
+{
+	if (v.empty())
+		lua_pushnil(l);
+	else
+		l_data_type<std::string>(v).push(l);
+}
+
+/* Upvalues: the modifications and the position of the next record */
+static int l_records_next(lua_State *l)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l,
+			lua_upvalueindex(1));
+	size_t i = lua_tointeger(l, lua_upvalueindex(2));
+	const Modification *m;
+	std::string name;
+	size_t sep;
+
+	if (i >= p->size())
+		return 0;
+	lua_pushinteger(l, i + 1);
+	lua_replace(l, lua_upvalueindex(2));
+
+	m = (*p)[i];
+	name = m->GetName();
+	sep = name.find("::");
+	l_data_type<std::string>(m->GetLayerName()).push(l);
+	if (sep == std::string::npos)
+		lua_pushnil(l);
+	else
+		l_data_type<std::string>(name.substr(sep + 2)).push(l);
+	lua_pushinteger(l, m->getOffset());
+	lua_pushinteger(l, m->GetLength());
+	switch (m->GetType()) {
+	case Modification::ADDED:
+		lua_pushnil(l);
+		push_value(l, m->GetOldValue());
+		break;
+	case Modification::REMOVED:
+		push_value(l, m->GetOldValue());
+		lua_pushnil(l);
+		break;
+	default:
+		push_value(l, m->GetOldValue());
+		push_value(l, m->GetNewValue());
+	}
+	return 6;
+}
+
+static int l_records(lua_State *l)
+{
+	l_packetmodifications_ref::extract(l, 1);
+	lua_pushvalue(l, 1);
+	lua_pushinteger(l, 0);
+	lua_pushcclosure(l, l_records_next, 2);
+	return 1;
+}
+
+/* The names of the modifications of the given type */
+static int l_names(lua_State *l, Modification::Type type)
+{
+	PacketModifications *p = l_packetmodifications_ref::extract(l, 1);
+	int n = 0;
+
+	lua_newtable(l);
+	for (const Modification *m : *p) {
+		if (m->GetType() != type)
+			continue;
+		l_data_type<std::string>(m->GetName()).push(l);
+		lua_rawseti(l, -2, ++n);
+	}
+	return 1;
+}
+
+static int l_added(lua_State *l)
+{
+	return l_names(l, Modification::ADDED);
+}
+
+static int l_removed(lua_State *l)
+{
+	return l_names(l, Modification::REMOVED);
+}
+
 void l_packetmodifications_ref::register_members(lua_State *l)
 {
 	l_ref<PacketModifications>::register_members(l);
@@ -102,6 +341,122 @@ void l_packetmodifications_ref::register_members(lua_State *l)
 	 * @treturn num partial 0 if not from a partial header
 	 */
 	meta_bind_func(l, "partial", l_partial);
+	/***
+	 * Check if the modifications only contain the changes since the
+	 * previous responsive hop
+	 * @function incremental
+	 * @treturn bool incremental
+	 * @see Globals.tracebox_args
+	 */
+	meta_bind_func(l, "incremental", l_incremental);
+	/***
+	 * Get all the modifications since the original probe. If these
+	 * modifications are not incremental, returns them as is.
+	 * @function cumulative
+	 * @treturn PacketModifications mod
+	 */
+	meta_bind_func(l, "cumulative", l_get_cumulative);
+	/***
+	 * Get the extensions appended to the ICMP error (RFC 4884), e.g.
+	 * the MPLS label stack (RFC 4950) or the interface information
+	 * (RFC 5837). Each object is a table with a name (MPLS, Interface or
+	 * Class<n>), a class and a ctype. MPLS objects have a list of labels,
+	 * each with a label, tc, s and ttl. Interface objects have a role and
+	 * the ifindex, addr, name and mtu they carry.
+	 * @function extensions
+	 * @treturn table objects the list of extension objects, possibly empty
+	 * @usage for _, o in ipairs(mods:extensions()) do
+	 *	if o.labels then print(o.labels[1].label) end
+	 * end
+	 */
+	meta_bind_func(l, "extensions", l_extensions);
+	/***
+	 * Get the canonical representation of the set of modifications, i.e.
+	 * the name of each modification in lexicographic order
+	 * @function fingerprint
+	 * @treturn string fingerprint
+	 */
+	meta_bind_func(l, "fingerprint", l_fingerprint);
+	/***
+	 * Get the ID shared by all the sets of modifications having the same
+	 * fingerprint, within the script
+	 * @function pattern
+	 * @treturn num id
+	 * @see Globals.modification_pattern
+	 */
+	meta_bind_func(l, "pattern", l_pattern);
+	/***
+	 * Release the original and received packets, only keeping the
+	 * modifications, the router, the RTT, the extensions and the beginning
+	 * of the quote. @{original} and @{received} then return nil.
+	 * @function compact
+	 * @tparam[opt=64] num len the number of bytes of the quote to keep
+	 * @see Globals.set_packet_ring
+	 */
+	meta_bind_func(l, "compact", l_compact);
+	/***
+	 * Check if the packets have been released by @{compact}
+	 * @function is_compact
+	 * @treturn bool compact
+	 */
+	meta_bind_func(l, "is_compact", l_is_compact);
+	/***
+	 * Get the source address of the received packet
+	 * @function router
+	 * @treturn string addr or nil if nothing has been received
+	 */
+	meta_bind_func(l, "router", l_router);
+	/***
+	 * Get the delay between the original and the received packets
+	 * @function rtt
+	 * @treturn num nsec or nil if nothing has been received
+	 */
+	meta_bind_func(l, "rtt", l_rtt);
+	/***
+	 * Get the beginning of the quote kept by @{compact}
+	 * @function snippet
+	 * @treturn table bytes a list of numbers [0-255], empty if the
+	 * modifications are not compact or if nothing has been quoted
+	 */
+	meta_bind_func(l, "snippet", l_snippet);
+	/***
+	 * Check if a field, an option or a whole layer has been modified,
+	 * added or removed, without formatting the modifications
+	 * @function has
+	 * @tparam string name a field (e.g. IP::TTL), an option (e.g.
+	 * TCPOption::MSS) or a layer (e.g. IP, RawLayer), prefixed by + or -
+	 * to only match additions or deletions
+	 * @treturn bool found
+	 * @usage if mods:has("+RawLayer") then print("Payload added") end
+	 */
+	meta_bind_func(l, "has", l_has);
+	/***
+	 * Iterate over the modifications
+	 * @function records
+	 * @treturn function an iterator returning the layer, the field (nil
+	 * for a whole layer), the offset and the length (in bits), and the old
+	 * and the new value of each modification. The old value is nil for
+	 * an addition, and the new one for a removal, the other one then
+	 * describing the added or removed layer or option. The values of a
+	 * whole layer, added, removed or changed, are the multi-line dumps of
+	 * Layer::Print().
+	 * @usage for layer, field, off, len, old, new in mods:records() do
+	 *	print(layer, field, old, new)
+	 * end
+	 */
+	meta_bind_func(l, "records", l_records);
+	/***
+	 * Get the layers and options that have been added
+	 * @function added
+	 * @treturn table names e.g. RawLayer or TCPOption::MSS
+	 */
+	meta_bind_func(l, "added", l_added);
+	/***
+	 * Get the layers and options that have been removed
+	 * @function removed
+	 * @treturn table names e.g. RawLayer or TCPOption::MSS
+	 */
+	meta_bind_func(l, "removed", l_removed);
 }
 
 void l_packetmodifications_ref::debug(std::ostream& out)
@@ -21,6 +21,7 @@ struct l_packetmodifications_ref : public l_ref<PacketModifications> {
 	static int l_PacketModifications(lua_State *l);
 	static int l_get_original(lua_State *l);
 	static int l_get_received(lua_State *l);
+	static int l_get_cumulative(lua_State *l);
 	static void register_members(lua_State *l);
 };
 
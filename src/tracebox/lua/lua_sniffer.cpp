@@ -1,6 +1,17 @@
 #include "lua_sniffer.h"
 #include "lua_packet.hpp"
+#include "lua_arg.h"
 #include "../tracebox.h"
+#include "../NFTables.h"
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+extern lua_State* l_init();
 
 static int l_sniffer_cb(Crafter::Packet *p, void *ctx)
 {
@@ -24,6 +35,66 @@ static int l_sniffer_cb(Crafter::Packet *p, void *ctx)
 	return ret;
 }
 
+/* The optional timeout in seconds at index n, NULL to block */
+static struct timespec *l_timeout(lua_State *l, int n, struct timespec *ts)
+{
+	double tmout;
+
+	if (lua_gettop(l) < n || lua_isnil(l, n))
+		return NULL;
+	tmout = l_data_type<double>::extract(l, n);
+	if (tmout < 0)
+		tmout = 0;
+	ts->tv_sec = tmout;
+	ts->tv_nsec = (tmout - ts->tv_sec) * 1e9;
+	return ts;
+}
+
+static void l_push_addr(lua_State *l, int version, const unsigned char *a)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (inet_ntop(version == 4 ? AF_INET : AF_INET6, a, buf, sizeof(buf)))
+		lua_pushstring(l, buf);
+	else
+		lua_pushnil(l);
+}
+
+static bool l_sniffer_filter(const SnifferFrame *f, void *ctx)
+{
+	l_sniffer_ref *s = static_cast<l_sniffer_ref*>(ctx);
+	lua_State *l = s->ctx;
+	SnifferHeaders h;
+	bool keep;
+
+	lua_rawgeti(l, LUA_REGISTRYINDEX, s->filter);
+	if (f->peek(&h)) {
+		lua_pushnumber(l, h.proto);
+		l_push_addr(l, h.version, h.src);
+		if (h.sport >= 0)
+			lua_pushnumber(l, h.sport);
+		else
+			lua_pushnil(l);
+		l_push_addr(l, h.version, h.dst);
+		if (h.dport >= 0)
+			lua_pushnumber(l, h.dport);
+		else
+			lua_pushnil(l);
+	} else {
+		for (int i = 0; i < 5; ++i)
+			lua_pushnil(l);
+	}
+	if (lua_pcall(l, 5, 1, 0)) {
+		std::cerr << "Error in the filter: " << lua_tostring(l, -1) <<
+			std::endl;
+		lua_pop(l, 1);
+		return false;
+	}
+	keep = lua_toboolean(l, -1);
+	lua_pop(l, 1);
+	return keep;
+}
+
 /***
  * An object that will intercept packets
  * @classmod TbxSniffer
@@ -31,13 +102,84 @@ static int l_sniffer_cb(Crafter::Packet *p, void *ctx)
 /***
  * Constructs a new TbxSniffer
  * @function new
- * @tparam table key a list of arguments that will be passed to iptables
+ * @tparam table key a list of arguments that will be passed to iptables. The
+ * "packet" backend only supports -p, --sport and --dport
+ * @tparam[opt] table args see @{new_args}
  * @usage TbxSniffer.new({'-p', 'tcp', '--dport', '80'}, callback_func)
  * @treturn TbxSniffer
  */
+/***
+ * Constructor arguments
+ * @table new_args
+ * @tfield string backend "nfqueue" (the default) to divert the packets
+ * through an iptables rule, or "packet" to observe copies of them in a
+ * memory-mapped ring, through a BPF filter, without changing the firewall
+ * @tfield string iface the interface captured by the "packet" backend, all
+ * of them by default
+ * @tfield num ring the number of packets that can be queued until they are
+ * received, 4096 by default
+ * @tfield string overflow what to do with the packets received while the
+ * queue is full: "drop" them (the default, also "drop_newest"), make room by
+ * dropping the oldest queued packet ("drop_oldest"), or "block" until there
+ * is room
+ * @tfield num queues the number of NFQUEUE queues (or packet sockets) among
+ * which the kernel spreads the flows, 1 by default. Sniffers with a single
+ * queue share one reading thread, the queues of the others have their own
+ * @tfield num cpu the CPU to which the thread reading the first queue is
+ * pinned, the next ones going to the following CPUs
+ * @tfield bool fail_open let the packets through instead of dropping them
+ * when the kernel queue is full
+ * @tfield num rcvbuf the size of the netlink socket buffers, 2MB by default
+ * @tfield num workers the number of Lua states processing the packets in
+ * parallel with @{start_workers}, each flow always going to the same one, 1
+ * by default. @{recv} only gets the flows of the first one.
+ */
 int l_sniffer_ref::l_Sniffer(lua_State *l)
 {
+	SnifferConfig config;
+	int ring = config.ring_size, queues = config.queues, cpu = config.cpu,
+		rcvbuf = config.rcvbuf, workers = config.consumers;
+	const char *overflow = "drop", *backend = "nfqueue", *iface = "";
+
 	luaL_checktype(l, 1, LUA_TTABLE);
+	if (lua_gettop(l) > 1) {
+		v_arg_integer_opt(l, 2, "ring", &ring);
+		v_arg_string_opt(l, 2, "overflow", &overflow);
+		v_arg_integer_opt(l, 2, "queues", &queues);
+		v_arg_integer_opt(l, 2, "cpu", &cpu);
+		v_arg_boolean_opt(l, 2, "fail_open", &config.fail_open);
+		v_arg_integer_opt(l, 2, "rcvbuf", &rcvbuf);
+		v_arg_string_opt(l, 2, "backend", &backend);
+		v_arg_string_opt(l, 2, "iface", &iface);
+		v_arg_integer_opt(l, 2, "workers", &workers);
+	}
+	if (ring <= 0)
+		return luaL_argerror(l, 2, "The ring must hold at least one packet");
+	if (queues <= 0)
+		return luaL_argerror(l, 2, "The sniffer needs at least one queue");
+	if (workers <= 0)
+		return luaL_argerror(l, 2, "The sniffer needs at least one worker");
+	config.consumers = workers;
+	config.ring_size = ring;
+	config.queues = queues;
+	config.cpu = cpu;
+	config.rcvbuf = rcvbuf;
+	if (!strcmp(overflow, "drop") || !strcmp(overflow, "drop_newest"))
+		config.overflow = SNIFFER_DROP_NEWEST;
+	else if (!strcmp(overflow, "drop_oldest"))
+		config.overflow = SNIFFER_DROP_OLDEST;
+	else if (!strcmp(overflow, "block"))
+		config.overflow = SNIFFER_BLOCK;
+	else
+		return luaL_argerror(l, 2, "Unknown overflow policy");
+	if (!strcmp(backend, "nfqueue"))
+		config.backend = SNIFFER_NFQUEUE;
+	else if (!strcmp(backend, "packet"))
+		config.backend = SNIFFER_PACKET;
+	else
+		return luaL_argerror(l, 2, "Unknown sniffer backend");
+	config.iface = iface;
+
 	std::vector<const char*> key;
 	for (int i = 1; ; ++i, lua_pop(l, 1)) {
 		lua_rawgeti(l, 1, i);
@@ -48,8 +190,17 @@ int l_sniffer_ref::l_Sniffer(lua_State *l)
 		const char* arg = luaL_checkstring(l, -1);
 		key.push_back(arg);
 	}
-	TbxSniffer *s = new TbxSniffer(key);
-	new l_sniffer_ref(s, l);
+	if (config.backend == SNIFFER_PACKET) {
+		NFTMatch m;
+
+		if (!NFTRules::ParseMatch(std::vector<std::string>(key.begin(),
+						key.end()), &m))
+			return luaL_argerror(l, 1,
+					"The packet backend only supports -p, --sport and --dport");
+	}
+	TbxSniffer *s = new TbxSniffer(key, config);
+	l_sniffer_ref *r = new l_sniffer_ref(s, l);
+	r->workers = workers;
 	return 1;
 }
 /***
@@ -77,6 +228,10 @@ int l_sniffer_ref::l_start(lua_State *l)
 		s->ref->start();
 	} else {
 		luaL_checktype(l, 2, LUA_TFUNCTION);
+		/* The callback would run in several threads at once */
+		if (s->workers > 1)
+			return luaL_error(l, "A sniffer with workers must be started "
+					"with start_workers");
 		s->cb = luaL_ref(l, LUA_REGISTRYINDEX);
 		s->ref->start(l_sniffer_cb, s);
 		luaL_unref(s->ctx, LUA_REGISTRYINDEX, s->cb);
@@ -84,6 +239,231 @@ int l_sniffer_ref::l_start(lua_State *l)
 	return 0;
 }
 
+/* A value returned by a worker, copied out of its state */
+struct l_worker_result {
+	int type;
+	lua_Number n;
+	std::string s;
+};
+
+/* Gathers the results of the workers for the state that started them */
+struct l_worker_pool {
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<l_worker_result> results;
+	/* Number of workers still running */
+	size_t running;
+	/* Set when the workers must return */
+	std::atomic<bool> quit;
+
+	explicit l_worker_pool(size_t n) : running(n), quit(false) {}
+
+	/* Copy the value at the top of the stack of l */
+	void push(lua_State *l)
+	{
+		l_worker_result r;
+
+		r.type = lua_type(l, -1);
+		switch (r.type) {
+		case LUA_TBOOLEAN:
+			r.n = lua_toboolean(l, -1);
+			break;
+		case LUA_TNUMBER:
+			r.n = lua_tonumber(l, -1);
+			break;
+		case LUA_TSTRING: {
+			size_t len;
+			const char *str = lua_tolstring(l, -1, &len);
+			r.s.assign(str, len);
+			break;
+		}
+		default:
+			std::cerr << "A worker returned a " << lua_typename(l, r.type) <<
+				", only booleans, numbers and strings can be passed " <<
+				"on" << std::endl;
+			return;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		results.push_back(r);
+		cond.notify_one();
+	}
+
+	void exit()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		--running;
+		cond.notify_one();
+	}
+};
+
+static void l_push_result(lua_State *l, const l_worker_result &r)
+{
+	switch (r.type) {
+	case LUA_TBOOLEAN:
+		lua_pushboolean(l, r.n != 0);
+		break;
+	case LUA_TNUMBER:
+		lua_pushnumber(l, r.n);
+		break;
+	default:
+		lua_pushlstring(l, r.s.data(), r.s.size());
+	}
+}
+
+/* The loop of a worker, handling the packets of its consumer */
+static void l_worker_run(TbxSniffer *s, size_t consumer, lua_State *l,
+		int handler, l_worker_pool *pool)
+{
+	int err_handler;
+
+	lua_pushcfunction(l, lua_traceback);
+	err_handler = lua_gettop(l);
+	while (!pool->quit && s->sniffing()) {
+		struct timespec t = { 1, 0 };
+		Crafter::Packet *p = s->recv(&t, consumer);
+		if (!p)
+			continue;
+		lua_rawgeti(l, LUA_REGISTRYINDEX, handler);
+		new l_packet_ref(p, l);
+		if (lua_pcall(l, 1, 1, err_handler)) {
+			std::cerr << "Error in worker " << consumer << ": " <<
+				lua_tostring(l, -1) << std::endl;
+			lua_pop(l, 1);
+			pool->quit = true;
+			break;
+		}
+		if (!lua_isnil(l, -1))
+			pool->push(l);
+		lua_pop(l, 1);
+	}
+	lua_pop(l, 1);
+	pool->exit();
+}
+
+/***
+ * The function handling the packets in a worker, returned by its chunk
+ * @function worker_handler
+ * @tparam Packet pkt the received packet
+ * @return a boolean, number or string given to the @{worker_callback},
+ * or nil
+ */
+
+/***
+ * The function receiving the results of the workers
+ * @function worker_callback
+ * @param res the value returned by a @{worker_handler}
+ * @treturn num x any value but 0 will stop the Sniffer
+ */
+
+/***
+ * Start sniffing, and process the packets in parallel in as many Lua
+ * states as the sniffer has workers, each in its own thread, until the
+ * sniffer is interrupted. Each state is set up like the one of tracebox, and
+ * then runs the chunk, which returns the handler of the packets of the
+ * state. The packets of a flow always go to the same state, which can thus
+ * keep the state of the flow in its globals. The states cannot share
+ * anything else but the pcap output, and they must not use the firewall.
+ * Each of them has its own copy of the settings of this state, e.g. from
+ * @{set_ttl_range}, and cannot replay a pcap file.
+ * @function start_workers
+ * @tparam string chunk the Lua code of the workers, returning a
+ * @{worker_handler}
+ * @tparam[opt] function cb called in this state with each result, see
+ * @{worker_callback}
+ * @usage s = TbxSniffer.new({'-p', 'tcp'}, {queues = 4, workers = 4})
+ * s:start_workers([[
+ *	local n = 0
+ *	return function(pkt) n = n + 1; return n end
+ * ]], function(n) print(n) end)
+ */
+int l_sniffer_ref::l_start_workers(lua_State *l)
+{
+	l_sniffer_ref *s = dynamic_cast<l_sniffer_ref *>(get_instance(l, 1));
+	std::vector<std::thread> threads;
+	std::vector<lua_State *> states;
+	/* A session runs a single trace at a time, each worker has a fork */
+	std::vector<TraceSession *> sessions;
+	std::vector<int> handlers;
+	size_t len;
+	const char *chunk;
+	int err_handler, ret = 0;
+
+	if (!s)
+		return luaL_argerror(l, 1, "The parameter is not a real sniffer instance!");
+	chunk = luaL_checklstring(l, 2, &len);
+	if (lua_gettop(l) > 2 && !lua_isnil(l, 3))
+		luaL_checktype(l, 3, LUA_TFUNCTION);
+	/* The filter would run in the threads of the workers */
+	if (s->filter != LUA_NOREF)
+		return luaL_error(l, "The workers cannot be used with a filter");
+
+	for (int i = 0; i < s->workers; ++i) {
+		lua_State *w = l_init();
+
+		states.push_back(w);
+		sessions.push_back(l_get_session(l)->Fork());
+		l_set_session(w, sessions.back());
+		if (luaL_loadbuffer(w, chunk, len, "worker") ||
+				lua_pcall(w, 0, 1, 0) || !lua_isfunction(w, -1)) {
+			lua_pushfstring(l, "Cannot start the workers: %s",
+					lua_isstring(w, -1) ? lua_tostring(w, -1) :
+					"the chunk must return a function");
+			for (lua_State *st : states)
+				lua_close(st);
+			for (TraceSession *ts : sessions)
+				delete ts;
+			return lua_error(l);
+		}
+		handlers.push_back(luaL_ref(w, LUA_REGISTRYINDEX));
+	}
+
+	l_worker_pool pool(s->workers);
+	s->ref->start();
+	for (int i = 0; i < s->workers; ++i)
+		threads.push_back(std::thread(l_worker_run, s->ref, i, states[i],
+					handlers[i], &pool));
+
+	lua_pushcfunction(l, lua_traceback);
+	err_handler = lua_gettop(l);
+	while (!ret) {
+		std::unique_lock<std::mutex> guard(pool.lock);
+		if (pool.results.empty()) {
+			if (!pool.running || pool.quit || !s->ref->sniffing())
+				break;
+			pool.cond.wait_for(guard, std::chrono::seconds(1));
+			continue;
+		}
+		l_worker_result r = pool.results.front();
+		pool.results.pop_front();
+		guard.unlock();
+
+		if (lua_gettop(l) < 3 || lua_isnil(l, 3))
+			continue;
+		lua_pushvalue(l, 3);
+		l_push_result(l, r);
+		if (lua_pcall(l, 1, 1, err_handler)) {
+			std::cerr << "Error in the callback: " << lua_tostring(l, -1) <<
+				std::endl;
+			ret = -1;
+		} else if (lua_isnumber(l, -1)) {
+			ret = lua_tonumber(l, -1);
+		}
+		lua_pop(l, 1);
+	}
+	lua_pop(l, 1);
+
+	/* Wakes the workers up */
+	pool.quit = true;
+	s->ref->stop();
+	for (std::thread &t : threads)
+		t.join();
+	for (lua_State *st : states)
+		lua_close(st);
+	for (TraceSession *ts : sessions)
+		delete ts;
+	return 0;
+}
+
 /***
  * Stop sniffing
  * @function stop
@@ -104,27 +484,260 @@ int l_sniffer_ref::l_stop(lua_State *l)
 int l_sniffer_ref::l_recv(lua_State *l)
 {
 	TbxSniffer *s = l_sniffer_ref::extract(l, 1);
+	l_sniffer_ref *r = dynamic_cast<l_sniffer_ref *>(get_instance(l, 1));
+	struct timespec ts;
 	Crafter::Packet *p;
-	if (lua_gettop(l) > 1) {
-		double tmout = l_data_type<double>::extract(l, 2);
-		struct timespec ts = {(long)tmout, (long)(tmout * 10e9)};
-		p = s->recv(&ts);
-	} else {
-		p = s->recv(NULL);
-	}
+
+	/* The filter runs in the calling state */
+	if (r)
+		r->ctx = l;
+	p = s->recv(l_timeout(l, 2, &ts));
 	if (p){
 		new l_packet_ref(p, l);
-		writePcap(p);
+		l_get_session(l)->WritePcap(p);
 	}else
 		lua_pushnil(l);
 	return 1;
 }
 
+/***
+ * Receive the packets that are queued at once, waiting for the first one
+ * only
+ * @function recv_batch
+ * @tparam num max the largest number of packets to receive
+ * @tparam[opt] num timeout number of second to wait for the first packet,
+ * can be decimal, or omit to block
+ * @treturn table the received packets, empty if timed out
+ * @usage for _, p in ipairs(sniffer:recv_batch(64, 1)) do print(p) end
+ */
+int l_sniffer_ref::l_recv_batch(lua_State *l)
+{
+	TbxSniffer *s = l_sniffer_ref::extract(l, 1);
+	l_sniffer_ref *r = dynamic_cast<l_sniffer_ref *>(get_instance(l, 1));
+	int max = l_data_type<int>::extract(l, 2);
+	std::vector<Crafter::Packet*> pkts;
+	struct timespec ts;
+
+	if (max <= 0)
+		return luaL_argerror(l, 2, "At least one packet must be received");
+	if (r)
+		r->ctx = l;
+	s->recv_batch(pkts, max, l_timeout(l, 3, &ts));
+	lua_createtable(l, pkts.size(), 0);
+	for (size_t i = 0; i < pkts.size(); ++i) {
+		new l_packet_ref(pkts[i], l);
+		lua_rawseti(l, -2, i + 1);
+		l_get_session(l)->WritePcap(pkts[i]);
+	}
+	return 1;
+}
+
+/***
+ * The filter function for the sniffer, called with the headers of each
+ * packet before it is decoded. All the arguments are nil if the packet is
+ * neither IPv4 nor IPv6.
+ * @function sniffer_filter
+ * @tparam num proto the protocol following the network header
+ * @tparam string src the source address
+ * @tparam num sport the source port, nil unless the packet holds TCP or
+ * UDP ports
+ * @tparam string dst the destination address
+ * @tparam num dport the destination port
+ * @treturn bool keep whether the packet must be received
+ */
+
+/***
+ * Discard the packets that the script does not care about, before they are
+ * turned into Packet objects
+ * @function filter
+ * @tparam[opt] function f see @{sniffer_filter}, omit to receive all the
+ * packets
+ * @usage sniffer:filter(function(proto, src, sport) return sport == 80 end)
+ */
+int l_sniffer_ref::l_filter(lua_State *l)
+{
+	l_sniffer_ref *s = dynamic_cast<l_sniffer_ref *>(get_instance(l, 1));
+	if (!s)
+		return luaL_argerror(l, 1, "The parameter is not a real sniffer instance!");
+
+	s->ref->set_filter(NULL, NULL);
+	luaL_unref(l, LUA_REGISTRYINDEX, s->filter);
+	s->filter = LUA_NOREF;
+	if (lua_gettop(l) > 1 && !lua_isnil(l, 2)) {
+		luaL_checktype(l, 2, LUA_TFUNCTION);
+		lua_settop(l, 2);
+		s->filter = luaL_ref(l, LUA_REGISTRYINDEX);
+		s->ctx = l;
+		s->ref->set_filter(l_sniffer_filter, s);
+	}
+	return 0;
+}
+
+/***
+ * Wait until one of several started sniffers has a packet to receive, or
+ * was stopped. The packet can then be retrieved with @{recv}, which may
+ * still return nil if the @{filter} discards it.
+ * @function wait
+ * @tparam table sniffers a list of TbxSniffer
+ * @tparam[opt] num timeout number of second to wait, can be decimal, or omit
+ * to block
+ * @treturn TbxSniffer the ready sniffer, or nil if timed out
+ * @treturn num its index in the list
+ * @usage local s = TbxSniffer.wait({tcp, udp}, 1)
+ */
+int l_sniffer_ref::l_wait(lua_State *l)
+{
+	std::vector<TbxSniffer*> sniffers;
+	struct timespec ts;
+	int i;
+
+	luaL_checktype(l, 1, LUA_TTABLE);
+	for (i = 1; ; ++i, lua_pop(l, 1)) {
+		lua_rawgeti(l, 1, i);
+		if (lua_isnil(l, -1)) {
+			lua_pop(l, 1);
+			break;
+		}
+		sniffers.push_back(l_sniffer_ref::extract(l, -1));
+	}
+	if (sniffers.empty())
+		return luaL_argerror(l, 1, "No sniffer to wait for");
+
+	i = TbxSniffer::wait(sniffers, l_timeout(l, 2, &ts));
+	if (i < 0) {
+		lua_pushnil(l);
+		return 1;
+	}
+	lua_rawgeti(l, 1, i + 1);
+	lua_pushnumber(l, i + 1);
+	return 2;
+}
+
+/***
+ * Get the number of packets discarded because the queue was full
+ * @function dropped
+ * @treturn num dropped
+ */
+static int l_dropped(lua_State *l)
+{
+	TbxSniffer *s = l_sniffer_ref::extract(l, 1);
+	lua_pushnumber(l, s->dropped());
+	return 1;
+}
+
+/***
+ * Get the number of times packets were lost by the kernel because the
+ * sniffer did not read them fast enough
+ * @function overruns
+ * @treturn num overruns
+ */
+static int l_overruns(lua_State *l)
+{
+	TbxSniffer *s = l_sniffer_ref::extract(l, 1);
+	lua_pushnumber(l, s->overruns());
+	return 1;
+}
+
+static void l_push_field(lua_State *l, const char *name, uint64_t v)
+{
+	lua_pushnumber(l, v);
+	lua_setfield(l, -2, name);
+}
+
+static void l_push_histogram(lua_State *l, const char *name,
+		const SnifferHistogram &h)
+{
+	lua_newtable(l);
+	l_push_field(l, "count", h.count);
+	l_push_field(l, "sum", h.sum);
+	l_push_field(l, "max", h.max);
+	l_push_field(l, "p50", h.quantile(.5));
+	l_push_field(l, "p90", h.quantile(.9));
+	l_push_field(l, "p99", h.quantile(.99));
+	lua_newtable(l);
+	for (int i = 0; i < SNIFFER_HIST_BUCKETS; ++i) {
+		lua_pushnumber(l, h.buckets[i]);
+		lua_rawseti(l, -2, i + 1);
+	}
+	lua_setfield(l, -2, "buckets");
+	lua_setfield(l, -2, name);
+}
+
+/***
+ * A histogram of durations, in nsec
+ * @table histogram
+ * @tfield num count the number of durations
+ * @tfield num sum their sum
+ * @tfield num max the longest one
+ * @tfield num p50 an upper bound of the median
+ * @tfield num p90 an upper bound of the 90th percentile
+ * @tfield num p99 an upper bound of the 99th percentile
+ * @tfield table buckets the number of durations in [2^(i-1), 2^i) for each
+ * index i
+ */
+
+/***
+ * Sniffer statistics
+ * @table sniffer_stats
+ * @tfield num received the number of packets read from the kernel
+ * @tfield num filtered the number of packets discarded by the @{filter}
+ * @tfield num dropped see @{dropped}
+ * @tfield num overruns see @{overruns}
+ * @tfield num queued the number of packets waiting to be received
+ * @tfield num capacity the number of packets that can be queued
+ * @tfield histogram decode the time spent turning the packets into Packet
+ * objects, see @{histogram}
+ * @tfield histogram callback the time spent in the callback given to
+ * @{start}
+ */
+
+/***
+ * Get the statistics of the sniffer
+ * @function stats
+ * @treturn table see @{sniffer_stats}
+ */
+static int l_stats(lua_State *l)
+{
+	TbxSniffer *s = l_sniffer_ref::extract(l, 1);
+	SnifferStats st = s->stats();
+
+	lua_newtable(l);
+	l_push_field(l, "received", st.received);
+	l_push_field(l, "filtered", st.filtered);
+	l_push_field(l, "dropped", st.dropped);
+	l_push_field(l, "overruns", st.overruns);
+	l_push_field(l, "queued", st.queued);
+	l_push_field(l, "capacity", st.capacity);
+	l_push_histogram(l, "decode", st.decode);
+	l_push_histogram(l, "callback", st.callback);
+	return 1;
+}
+
+/***
+ * Print the statistics of the sniffer
+ * @function print_stats
+ */
+static int l_print_stats(lua_State *l)
+{
+	TbxSniffer *s = l_sniffer_ref::extract(l, 1);
+
+	s->stats().Print(std::cout);
+	return 0;
+}
+
 void l_sniffer_ref::register_members(lua_State *l)
 {
 	l_ref<TbxSniffer>::register_members(l);
 	meta_bind_func(l, "new", l_Sniffer);
 	meta_bind_func(l, "start", l_start);
+	meta_bind_func(l, "start_workers", l_start_workers);
 	meta_bind_func(l, "stop", l_stop);
 	meta_bind_func(l, "recv", l_recv);
+	meta_bind_func(l, "recv_batch", l_recv_batch);
+	meta_bind_func(l, "filter", l_filter);
+	meta_bind_func(l, "wait", l_wait);
+	meta_bind_func(l, "dropped", l_dropped);
+	meta_bind_func(l, "overruns", l_overruns);
+	meta_bind_func(l, "stats", l_stats);
+	meta_bind_func(l, "print_stats", l_print_stats);
 }
@@ -16,14 +16,22 @@ struct l_sniffer_ref : public l_ref<TbxSniffer> {
 
 	static int l_Sniffer(lua_State *l);
 	static int l_start(lua_State *l);
+	static int l_start_workers(lua_State *l);
 	static int l_stop(lua_State *l);
 	static int l_recv(lua_State *l);
+	static int l_recv_batch(lua_State *l);
+	static int l_filter(lua_State *l);
+	static int l_wait(lua_State *l);
 
 	static void register_members(lua_State *l);
 	static void register_globals(lua_State *l);
 
 	lua_State *ctx;
 	int cb;
+	/* Function set by filter() */
+	int filter = LUA_NOREF;
+	/* Number of consumers of the sniffer */
+	int workers = 1;
 };
 
 #endif
@@ -9,6 +9,7 @@
 #include "lua_packet.hpp"
 #include "lua_packetmodifications.h"
 #include "lua_arg.h"
+#include "lua_async.h"
 #include "../tracebox.h"
 
 /***
@@ -31,9 +32,19 @@
  */
 
 struct tracebox_info {
-	const char *cb;
+	/* Reference of the callback in the registry, or LUA_NOREF */
+	int cb;
 	lua_State *l;
-	std::shared_ptr<const Packet> rcv;
+	/* Index of lua_traceback in the stack of l */
+	int err_handler;
+	bool compact;
+	/* The modifications computed for the last probe */
+	std::shared_ptr<PacketModifications> mods;
+	/* Packet received from the destination, kept aside when the
+	 * modifications are compacted */
+	std::shared_ptr<const Packet> received;
+	/* Position of the probe given to tracebox_many(), or 0 */
+	int index;
 };
 
 /***
@@ -43,11 +54,13 @@ struct tracebox_info {
  * @tparam num ttl the current TTL value
  * @tparam string r_ip the ip of the router that echoed the probe
  * @tparam PacketModifications mod the packet modifications list
+ * @tparam[opt] num i the position of the probe, for @{tracebox_many}
  * @treturn[opt] num 1 to force tracebox to stop sending probes
  * @usage
  * function callback_func(ttl, r_ip, mod)
  * 	print("Sent probe n#" .. tll .. " and received " .. mod:modif():tostring())
  * end
+ * tracebox(IP/TCP, {callback = callback_func})
  * */
 static int tCallback(void *ctx, uint8_t ttl, std::string& ip,
 		PacketModifications *mod)
@@ -55,22 +68,19 @@ static int tCallback(void *ctx, uint8_t ttl, std::string& ip,
 	struct tracebox_info *info = (struct tracebox_info *)ctx;
 	int ret;
 
-	info->rcv = mod->modif;
-
-	if (!info->cb)
-		return 0;
-
-	lua_pushcfunction(info->l, lua_traceback);
-	int err_handler = lua_gettop(info->l);
-
-	lua_getglobal(info->l, info->cb);
-	if(lua_type(info->l, -1) != LUA_TFUNCTION) {
-		const char* msg = lua_pushfstring(info->l, "`%s' is not a function",
-				info->cb);
-		luaL_argerror(info->l, -1, msg);
-		return -1;
+	info->mods.reset(mod);
+	info->received.reset();
+	if (info->compact) {
+		/* Only the reply of the destination is returned by tracebox */
+		if (mod->reply && mod->orig->GetLayer<IPLayer>() &&
+				ip == mod->orig->GetLayer<IPLayer>()->GetDestinationIP())
+			info->received = mod->GetReceived();
+		mod->Compact();
 	}
+	if (info->cb == LUA_NOREF)
+		return 0;
 
+	lua_rawgeti(info->l, LUA_REGISTRYINDEX, info->cb);
 	l_data_type<int>(ttl).push(info->l);
 
 	if (ip == "")
@@ -78,46 +88,186 @@ static int tCallback(void *ctx, uint8_t ttl, std::string& ip,
 	else
 		l_data_type<std::string>(ip).push(info->l);
 
-	new l_packetmodifications_ref(mod, info->l);
+	new l_packetmodifications_ref(info->mods, info->l);
+	if (info->index)
+		lua_pushinteger(info->l, info->index);
 
-	int err = lua_pcall(info->l, 3, 1, err_handler);
+	int err = lua_pcall(info->l, info->index ? 4 : 3, 1, info->err_handler);
 
 	if (err) {
 		std::cerr << "Error in the callback: " <<
 			luaL_checkstring(info->l, -1) << std::endl;
-		lua_pop(info->l, 2);
+		lua_pop(info->l, 1);
 		return -1;
 	}
 	if (!lua_isnumber(info->l, -1)) {
-		lua_pop(info->l, 2);
+		lua_pop(info->l, 1);
 		return 0;
 	}
 	ret = lua_tonumber(info->l, -1);
-	lua_pop(info->l, 2);
+	lua_pop(info->l, 1);
 	return ret;
 }
 
+/* The reply of the destination, once doTracebox() returned ret */
+static int l_push_trace(lua_State *l, int ret, struct tracebox_info &info)
+{
+	/* Did the server reply ? */
+	if (!info.received && info.mods)
+		info.received = info.mods->GetReceived();
+	if (ret == 1 && info.received)
+		new l_packet_ref(new Packet(*info.received), l);
+	else
+		lua_pushnil(l);
+
+	return 1;
+}
+
+/* A trace run in the background, whose hops are reported to the callback
+ * by the state running the job */
+struct l_trace_job : public l_async_job {
+	/* The configuration of the trace, as the script can change the one of
+	 * the state in the meantime */
+	std::unique_ptr<TraceSession> fork;
+	TraceSession *session;
+	std::shared_ptr<Packet> probe;
+	bool incremental;
+	struct tracebox_info info;
+	/* The hop given to notify() */
+	uint8_t ttl;
+	std::string ip;
+	PacketModifications *mod;
+	int hop_ret;
+	/* Returned by doTracebox() */
+	int ret;
+	std::string err;
+	/* The callback to release with the job, if its own */
+	int own_cb;
+
+	/* Trace in a fork of s if forked is set, otherwise in s, which the
+	 * state must not use meanwhile */
+	l_trace_job(TraceSession *s, bool forked, const Packet &pkt,
+			const struct tracebox_info &info, bool incremental)
+		: fork(forked ? s->Fork() : NULL), session(forked ? fork.get() : s),
+		/* Its TTL changes with each hop */
+		probe(std::make_shared<Packet>(pkt)), incremental(incremental),
+		info(info), ttl(0), mod(NULL), hop_ret(0), ret(0), own_cb(LUA_NOREF)
+	{
+	}
+
+	static int hop(void *ctx, uint8_t ttl, std::string &ip,
+			PacketModifications *mod)
+	{
+		l_trace_job *job = static_cast<l_trace_job *>(ctx);
+
+		job->ttl = ttl;
+		job->ip = ip;
+		job->mod = mod;
+		/* The state is closing */
+		if (!job->post()) {
+			delete mod;
+			return -1;
+		}
+		return job->hop_ret;
+	}
+
+	void run()
+	{
+		ret = doTracebox(*session, probe, hop, err, this, incremental);
+	}
+
+	void notify(lua_State *l)
+	{
+		/* The batches give theirs */
+		if (info.err_handler || info.cb == LUA_NOREF) {
+			hop_ret = tCallback(&info, ttl, ip, mod);
+			return;
+		}
+		info.l = l;
+		lua_pushcfunction(l, lua_traceback);
+		info.err_handler = lua_gettop(l);
+		hop_ret = tCallback(&info, ttl, ip, mod);
+		lua_pop(l, 1);
+		info.err_handler = 0;
+	}
+
+	void discard(lua_State *l)
+	{
+		luaL_unref(l, LUA_REGISTRYINDEX, own_cb);
+	}
+
+	int results(lua_State *co)
+	{
+		luaL_unref(co, LUA_REGISTRYINDEX, own_cb);
+		if (ret < 0) {
+			std::cerr << "Tracebox error: " << err << std::endl;
+			lua_pushnil(co);
+			return 1;
+		}
+		return l_push_trace(co, ret, info);
+	}
+
+	/* Complete the addresses of the probe of the script, as tracebox()
+	 * does, before the job copies it */
+	static bool check(lua_State *l, Packet *pkt, std::string &err)
+	{
+		TraceSession *s = l_get_session(l);
+		std::string iface = s->iface;
+
+		return probe_sanity_check(*s, pkt, err, iface) != NULL;
+	}
+
+	/* Yield the coroutine l until the trace is over, which then
+	 * releases the callback */
+	static int start(lua_State *l, std::shared_ptr<Packet> pkt,
+			struct tracebox_info &info, bool incremental)
+	{
+		std::string err;
+		l_trace_job *job;
+
+		if (!check(l, pkt.get(), err)) {
+			luaL_unref(l, LUA_REGISTRYINDEX, info.cb);
+			const char* msg = lua_pushfstring(l, "Tracebox error: %s",
+					err.c_str());
+			return luaL_argerror(l, -1, msg);
+		}
+		job = new l_trace_job(l_get_session(l), true, *pkt, info,
+				incremental);
+		job->own_cb = info.cb;
+		job->info.err_handler = 0;
+		return l_async_call(l, job);
+	}
+};
+
 /***
  * Start sending the packet with increasing TTL values and compute the
- * differences
+ * differences. In a function started by @{async}, the trace runs in the
+ * background while the other functions go on.
  * @function tracebox
  * @tparam Packet pkt the probe packet
  * @tparam[opt] table args see tracebox_args
  * @treturn Packet the echoed packet from the destination or nil
  * @see tracebox_callback
+ * @see async
  * @usage tracebox(IP/TCP, { callback = 'callback_func'})
  * */
 /***
  * Tracebox optional keyword parameters
  * @table tracebox_args
- * @tfield string callback The callback function to call at each received probe, see tracebox_callback
+ * @tfield function callback The callback function to call at each received
+ * probe, or the name of a global one, see tracebox_callback
+ * @tfield bool incremental Compare each quote to the one of the previous
+ * responsive hop instead of to the probe, see @{PacketModifications:cumulative}
+ * @tfield bool compact Release the packets of each hop before calling the
+ * callback, see @{PacketModifications:compact}
  * */
 int l_Tracebox(lua_State *l)
 {
 	std::string err;
 	int ret = 0;
+	bool incremental = false;
 	std::shared_ptr<Packet> pref = l_packet_ref::get_owner<Packet>(l, 1);
-	static struct tracebox_info info = {NULL, l, NULL};
+	struct tracebox_info info = {LUA_NOREF, l, 0, false, NULL, NULL, 0};
 	Packet *pkt = pref.get();
 	if (!pkt) {
 		std::cerr << "doTracebox: no packet!" << std::endl;
@@ -126,28 +276,104 @@ int l_Tracebox(lua_State *l)
 	if (lua_gettop(l) == 1)
 		goto no_args;
 
-	v_arg_string_opt(l, 2, "callback", &info.cb);
+	v_arg_boolean_opt(l, 2, "incremental", &incremental);
+	v_arg_boolean_opt(l, 2, "compact", &info.compact);
+	v_arg_function_opt(l, 2, "callback", &info.cb);
 
 
 no_args:
-	ret = doTracebox(pref, tCallback, err, &info);
+	if (l_async_running(l) && !TraceSession::IsPcap(l_get_session(l)->iface))
+		return l_trace_job::start(l, pref, info, incremental);
+
+	/* For all the hops */
+	lua_pushcfunction(l, lua_traceback);
+	info.err_handler = lua_gettop(l);
+	ret = doTracebox(*l_get_session(l), pref, tCallback, err, &info,
+			incremental);
+	luaL_unref(l, LUA_REGISTRYINDEX, info.cb);
 	if (ret < 0) {
 		const char* msg = lua_pushfstring(l, "Tracebox error: %s", err.c_str());
 		luaL_argerror(l, -1, msg);
 		return 0;
 	}
 
-	/* Did the server reply ? */
-	if (ret == 1 && info.rcv.get())
-		new l_packet_ref(new Packet(*info.rcv), l);
-	else
-		lua_pushnil(l);
+	return l_push_trace(l, ret, info);
+}
 
-	return 1;
+/***
+ * Trace all the packets at once, as @{tracebox} does for each of them,
+ * with at most as many traces in flight as set by @{set_async_threads}.
+ * Their callbacks get the position of the probe as fourth argument. The
+ * traces run one after the other when replaying a pcap file.
+ * @function tracebox_many
+ * @tparam table pkts the list of probes
+ * @tparam[opt] table args see tracebox_args, and tracebox_many_args
+ * @treturn table the packets echoed by the destinations, or false, in the
+ * order of the probes, unless there is a result function
+ * @usage replies = tracebox_many({ip{dst=a} / TCP, ip{dst=b} / TCP})
+ * */
+/***
+ * Additional keyword parameters of tracebox_many
+ * @table tracebox_many_args
+ * @tfield function result called with the position of each probe and the
+ * packet echoed by its destination, or nil, as soon as its trace is over,
+ * instead of returning them
+ * */
+int l_tracebox_many(lua_State *l)
+{
+	TraceSession *s = l_get_session(l);
+	struct tracebox_info info = {LUA_NOREF, l, 0, false, NULL, NULL, 0};
+	bool incremental = false, replay = TraceSession::IsPcap(s->iface);
+	std::vector<l_async_job *> jobs;
+	std::vector<Packet *> pkts;
+	int result = 0;
+
+	luaL_checktype(l, 1, LUA_TTABLE);
+	if (lua_gettop(l) > 1) {
+		v_arg_boolean_opt(l, 2, "incremental", &incremental);
+		v_arg_boolean_opt(l, 2, "compact", &info.compact);
+		lua_getfield(l, 2, "result");
+		if (lua_isnil(l, -1))
+			lua_pop(l, 1);
+		else if (lua_isfunction(l, -1))
+			result = lua_gettop(l);
+		else
+			return luaL_argerror(l, 2, "result must be a function");
+	}
+
+	for (size_t i = 1; i <= lua_objlen(l, 1); ++i) {
+		std::string err;
+		Packet *pkt;
+
+		lua_rawgeti(l, 1, i);
+		pkt = l_packet_ref::extract(l, -1);
+		lua_pop(l, 1);
+		if (!l_trace_job::check(l, pkt, err))
+			return luaL_error(l, "Tracebox error for probe %d: %s", (int)i,
+					err.c_str());
+		pkts.push_back(pkt);
+	}
+	if (lua_gettop(l) > 1)
+		v_arg_function_opt(l, 2, "callback", &info.cb);
+
+	/* Shared by the jobs, as all their hops are handled here */
+	lua_pushcfunction(l, lua_traceback);
+	info.err_handler = lua_gettop(l);
+	for (size_t i = 0; i < pkts.size(); ++i) {
+		info.index = i + 1;
+		jobs.push_back(new l_trace_job(s, !replay, *pkts[i], info,
+					incremental));
+	}
+	if (!result)
+		lua_createtable(l, jobs.size(), 0);
+	l_async_run_all(l, jobs, replay ? 1 : 0, result ? 0 : lua_gettop(l),
+			result);
+	luaL_unref(l, LUA_REGISTRYINDEX, info.cb);
+	return result ? 0 : 1;
 }
 
 /***
- * Set a new TTL range for further tracebox calls
+ * Set a new TTL range for further tracebox calls from this script
  * @function set_ttl_range
  * @tparam table args see set_ttl_range_args
  * @treturn table The old TTL table
@@ -160,13 +386,14 @@ no_args:
  * */
 int l_set_ttl_range(lua_State *l)
 {
-	int old_min = get_min_ttl(), old_max = get_max_ttl(), min_ttl, max_ttl,
+	TraceSession *s = l_get_session(l);
+	int old_min = s->hops_min, old_max = s->hops_max, min_ttl, max_ttl,
 			new_min, new_max;
 	bool min = v_arg_integer_opt(l, 1, "min_ttl", &min_ttl);
 	bool max = v_arg_integer_opt(l, 1, "max_ttl", &max_ttl);
 	new_min = min ? min_ttl : old_min;
 	new_max = max ? max_ttl : old_max;
-	if ((min || max) &&	set_tracebox_ttl_range(new_min, new_max))
+	if ((min || max) &&	s->SetTTLRange(new_min, new_max))
 		return luaL_error(l, "Invalid TTL range: [%d <= %d]", new_min, new_max);
 	lua_createtable(l, 0, 2);
 	lua_pushstring(l, "min_ttl");
@@ -177,3 +404,39 @@ int l_set_ttl_range(lua_State *l)
 	lua_settable(l, -3);
 	return 1;
 }
+
+/***
+ * Keep the packets released by the last compacted modifications, for
+ * debugging
+ * @function set_packet_ring
+ * @tparam num size the number of hops to keep, 0 to disable the ring
+ * @treturn num the previous size
+ * @see PacketModifications:compact
+ * */
+int l_set_packet_ring(lua_State *l)
+{
+	lua_pushinteger(l, PacketRing::SetCapacity(luaL_checkinteger(l, 1)));
+	return 1;
+}
+
+/***
+ * Get the packets kept by the ring enabled with set_packet_ring
+ * @function packet_ring
+ * @treturn table a list of tables with the original and received Packet,
+ * from the oldest to the most recent hop
+ * */
+int l_packet_ring(lua_State *l)
+{
+	std::vector<PacketRing::Entry> entries = PacketRing::Get();
+
+	lua_createtable(l, entries.size(), 0);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		lua_createtable(l, 0, 2);
+		new l_packet_ref(new Packet(*entries[i].orig), l);
+		lua_setfield(l, -2, "original");
+		new l_packet_ref(new Packet(*entries[i].reply), l);
+		lua_setfield(l, -2, "received");
+		lua_rawseti(l, -2, i + 1);
+	}
+	return 1;
+}
@@ -7,6 +7,7 @@
 
 #include "lua_base.hpp"
 #include "lua_arg.h"
+#include "../TraceSession.h"
 
 #include "crafter/Utils/IPResolver.h"
 
@@ -172,3 +173,21 @@ int l_random(lua_State *l)
 	l_data_type<int>(rand() % max).push(l);
 	return 1;
 }
+
+/***
+ * Return the fingerprint of a pattern of modifications
+ * @function modification_pattern
+ * @tparam num id the ID of the pattern, see @{PacketModifications:pattern}
+ * @treturn string the fingerprint, or nil if no such pattern has been seen
+ */
+int l_modification_pattern(lua_State *l)
+{
+	const std::string *fingerprint =
+		l_get_session(l)->GetPatterns().Get(luaL_checkinteger(l, 1));
+
+	if (fingerprint)
+		lua_pushstring(l, fingerprint->c_str());
+	else
+		lua_pushnil(l);
+	return 1;
+}
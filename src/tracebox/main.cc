@@ -0,0 +1,247 @@
+/**
+ * Tracebox -- A middlebox detection tool
+ *
+ *  Copyright 2013-2015 by its authors.
+ *  Some rights reserved. See LICENSE, AUTHORS.
+ */
+
+/* The tracebox command, on top of libtracebox */
+
+#include "config.h"
+#include "tracebox.h"
+#include "TraceSession.h"
+#include "TraceWriter.h"
+#include "PartialHeader.h"
+#include "script.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+using namespace Crafter;
+using namespace std;
+
+#ifdef HAVE_CURL
+extern void curlPost(const char *pcap_filename, const char *url);
+#endif
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret = EXIT_SUCCESS;
+	int dport = 80;
+	int net_proto = IP::PROTO, tr_proto = TCP::PROTO;
+	const char *script = NULL;
+	const char *probe = NULL;
+	Packet *pkt = NULL;
+	string err;
+	bool inline_script = false;
+	bool skip_suid_check = false;
+	bool incremental = false;
+	const char *pcap_filename = DEFAULT_PCAP_FILENAME;
+#ifdef HAVE_CURL
+	const char *upload_url = DEFAULT_URL;
+	bool upload = false;
+#endif
+	TraceSession session;
+	TraceWriter::Format format = TraceWriter::TEXT;
+	PartialTCP::register_type();
+
+	/* disable libcrafter warnings */
+	ShowWarnings = 0;
+	while ((c = getopt(argc, argv, "Sl:i:M:m:s:p:d:f:hnv6uwjt:VDI"
+#ifdef HAVE_CURL
+					"Cc:"
+#endif
+					)) != -1) {
+		switch (c) {
+			case 'S':
+				skip_suid_check = true;
+				break;
+			case 'i':
+				session.iface = optarg;
+				break;
+			case 'M':
+				session.hops_min = strtol(optarg, NULL, 10);
+				break;
+			case 'm':
+				session.hops_max = strtol(optarg, NULL, 10);
+				break;
+			case 'n':
+				session.resolve = false;
+				break;
+			case '6':
+				net_proto = IPv6::PROTO;
+				break;
+			case 'd':
+				dport = strtol(optarg, NULL, 10);
+				break;
+			case 'u':
+				tr_proto = UDP::PROTO;
+				break;
+			case 's':
+				script = optarg;
+				break;
+			case 'p':
+				probe = optarg;
+				break;
+			case 'v':
+				session.verbose = true;
+				break;
+			case 'j':
+				format = TraceWriter::JSON;
+				break;
+#ifdef HAVE_CURL
+			case 'c':
+				upload_url = optarg;
+				upload = true;
+				break;
+			case 'C':
+				upload = true;
+				break;
+#endif
+			case 'f' :
+				pcap_filename = optarg;
+				break;
+			case 'h':
+				ret = 0;
+				goto usage;
+			case 'w':
+				ShowWarnings = 1;
+				break;
+			case 'l':
+				script = optarg;
+				inline_script = true;
+				break;
+			case 't':
+				session.timeout = strtod(optarg, NULL);
+				break;
+			case 'V':
+				std::cerr << _REV_PARSE << std::endl;
+				return 0;
+			case 'D':
+				print_debug = true;
+				break;
+			case 'I':
+				incremental = true;
+				break;
+			case ':':
+				std::cerr << "Option `-" << (char)optopt
+							<< "' requires an argument!" << std::endl;
+				goto usage;
+				break;
+			case '?':
+				std::cerr << "Unknown option `-" << (char)optopt
+							<< "'." << std::endl;
+			default:
+				goto usage;
+		}
+	}
+
+    if (session.SetTTLRange(session.hops_min, session.hops_max) < 0) {
+		cerr << "Cannot use the specified TTL range: [" << (int)session.hops_min << ", " << (int)session.hops_max << "]" << std::endl;
+		goto usage;
+	}
+
+	if (!skip_suid_check && getuid() != 0) {
+		cerr << "tracebox requires superuser permissions!" << endl;
+		goto usage;
+	}
+
+	if (optind < argc) {
+		session.destination = argv[optind];
+	} else if (!inline_script && ! script) {
+		cerr << "You must specify a destination host" << endl;
+		goto usage;
+	}
+
+	if(session.OpenPcap(pcap_filename)){
+		return EXIT_FAILURE;
+	}
+
+	if (!probe && !script) {
+		pkt = BuildProbe(net_proto, tr_proto, dport);
+	} else if (probe && !script) {
+		string cmd = probe;
+		pkt = script_packet(cmd);
+	} else if (script && !probe) {
+		int rem_argc = argc - optind;
+		char **rem_argv = rem_argc ? &argv[optind] : NULL;
+		if (inline_script)
+			ret = script_exec(&session, script, rem_argc, rem_argv);
+		else
+			ret = script_execfile(&session, script, rem_argc, rem_argv);
+		goto out;
+	} else {
+		cerr << "You cannot specify a script and a probe at the same time" << endl;
+		goto usage;
+	}
+
+	if (!pkt)
+		return EXIT_FAILURE;
+
+	{
+		TraceWriter writer(session, format);
+
+		if (doTracebox(session, std::shared_ptr<Packet>(pkt),
+					TraceWriter::Callback, err, &writer, incremental) < 0) {
+			cerr << "Error: " << err << endl;
+			goto usage;
+		}
+		writer.Finish();
+	}
+out:
+	session.ClosePcap();
+#ifdef HAVE_CURL
+	if (upload) {
+		std::cerr << "Uploading pcap to " << upload_url << std::endl;
+		curlPost(pcap_filename, upload_url);
+	}
+#endif
+	return ret;
+
+usage:
+	cerr << "Usage:\n"
+"  " << argv[0] << " [ OPTIONS ] {host | [Lua argument list]}\n"
+"Options are:\n"
+"  -h                          Display this help and exit\n"
+"  -n                          Do not resolve IP adresses\n"
+"  -6                          Use IPv6 for static probe generated\n"
+"  -u                          Use UDP for static probe generated\n"
+"  -d port                     Use the specified port for static probe\n"
+"                              generated. Default is 80.\n"
+"  -i device                   Specify a network interface to operate with\n"
+"  -m hops_max                 Set the max number of hops (max TTL to be reached).\n"
+"                              Default is 30.\n"
+"  -M hops_min                 Set the min number of hops (min TTL to be reached).\n"
+"                              Default is 1. \n"
+"  -v                          Print more information.\n"
+"  -I                          Only report the modifications that appeared\n"
+"                              since the previous responsive hop.\n"
+"  -j                          Change the format of the output to JSON.\n"
+"  -t timeout                  Timeout to wait for a reply after sending a packet.\n"
+"                              Default is 1 sec, accepts decimals.\n"
+"  -p probe                    Specify the probe to send.\n"
+"  -s script_file              Run a script file.\n"
+"  -l inline_script            Run a script.\n"
+"  -w                          Show warnings when crafting packets.\n"
+#ifdef HAVE_LIBCURL
+"  -c server_url               Specify a server where captured packets will be sent.\n"
+"  -C                          Same than -c, but use the server at " DEFAULT_URL ".\n"
+#endif
+"  -f filename                 Specify the name of the pcap file.\n"
+"                              Default is " DEFAULT_PCAP_FILENAME ".\n"
+"  -S                          Skip the privilege check at the start.\n"
+"                              To be used mainly for testing purposes,\n"
+"	                           as it will cause tracebox to crash for some\n"
+"							   of its features!.\n"
+"  -V                          Print tracebox version and exit.\n"
+"  -D                          Print debug information.\n"
+"\n"
+"Every argument passed after the options in conjunction with -s or -l will be passed\n"
+"to the lua interpreter and available in a global vector of strings named 'argv',\n"
+"in the order they appeared on the command-line.\n"
+"\n\nVersion: " _REV_PARSE "\n"
+	<< endl;
+	return ret;
+}
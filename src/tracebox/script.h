@@ -11,8 +11,11 @@
 
 #include "crafter.h"
 
+class TraceSession;
+
 Crafter::Packet *script_packet(std::string& cmd);
-int script_exec(const char*, int, char**);
-int script_execfile(const char*, int, char**);
+/* Run a script, whose traces use the given session */
+int script_exec(TraceSession*, const char*, int, char**);
+int script_execfile(TraceSession*, const char*, int, char**);
 
 #endif
@@ -6,21 +6,40 @@
  */
 
 #include "sniffer.h"
+#include "SPSCRing.h"
+#include "NFTables.h"
+#include "Timestamp.h"
+#include "tracebox.h"
 
 #include <string>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <cstdlib>
 #include <unistd.h>
 extern "C" {
 	#include <pthread.h>
-	#include <semaphore.h>
+	#include <sched.h>
+	#include <poll.h>
+	#include <time.h>
 	#include <signal.h>
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+	#include <sys/mman.h>
+	#include <sys/socket.h>
 	#include <sys/wait.h>
+	#include <net/if.h>
 	#include <netinet/in.h>
 	#include <linux/types.h>
+	#include <linux/filter.h>
+	#include <linux/if_ether.h>
+	#include <linux/if_packet.h>
 	#include <linux/netfilter.h>
 }
 #include <libnetfilter_queue/libnetfilter_queue.h>
+#include <pcap.h>
 
 static volatile sig_atomic_t _killed = 0;
 
@@ -56,16 +75,19 @@ static int _exec(char* const *args)
 static int iptables(std::vector<std::string> &args)
 {
 	int err;
-	for( std::vector<std::string>::const_iterator i = args.begin(); i != args.end(); ++i)
-    	std::cerr << *i << " ";
-	std::cerr << std::endl;
+	if (print_debug) {
+		for (std::vector<std::string>::const_iterator i = args.begin();
+				i != args.end(); ++i)
+			std::cerr << *i << " ";
+		std::cerr << std::endl;
+	}
 	const char **argv = new const char* [args.size()+2];
 	for (size_t i = 0; i < args.size(); ++i)
 		argv[i+1] = args[i].c_str();
     argv[args.size()+1] = NULL;
 	argv[0] = "iptables";
 	if ((err = _exec((char* const*)argv))) {
-		delete argv;
+		delete[] argv;
 		return err;
 	}
 	argv[0] = "ip6tables";
@@ -75,80 +97,715 @@ static int iptables(std::vector<std::string> &args)
 }
 
 
+/* Time a reader sleeps while a ring is full, in SNIFFER_BLOCK */
+#define SNIFFER_BLOCK_WAIT_US 100
+
+/* Largest netlink message, holding a packet of up to 64k (the copy range)
+ * and its attributes, e.g. a GSO packet */
+#define SNIFFER_RECV_BUF_LEN (0xffff + 4096)
+
+/* Netlink messages read before the verdict of their packets is issued, so
+ * that the kernel queue does not fill up while they are pending */
+#define SNIFFER_VERDICT_BATCH 64
+
+/* Geometry of the TPACKET_V3 rings. The kernel hands a block over once it
+ * is full, or SNIFFER_BLOCK_TIMEOUT_MS after its first packet. */
+#define SNIFFER_BLOCK_SIZE (1 << 20)
+#define SNIFFER_BLOCK_NR 16
+#define SNIFFER_FRAME_SIZE 2048
+#define SNIFFER_BLOCK_TIMEOUT_MS 10
+
+static uint32_t read32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Hash of the addresses, protocol and ports of an IPv4 or IPv6 packet,
+ * which is the same in both directions */
+static uint32_t flow_hash(const unsigned char *p, int len)
+{
+	uint32_t h;
+	int proto, off;
+
+	if (len < 1)
+		return 0;
+	switch (p[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return 0;
+		h = read32(p + 12) ^ read32(p + 16);
+		proto = p[9];
+		off = (p[0] & 0x0f) * 4;
+		/* Keep all the fragments of a datagram together */
+		if ((p[6] & 0x3f) || p[7])
+			off = len;
+		break;
+	case 6:
+		if (len < 40)
+			return 0;
+		h = 0;
+		for (int i = 8; i < 40; i += 4)
+			h ^= read32(p + i);
+		proto = p[6];
+		off = 40;
+		break;
+	default:
+		return 0;
+	}
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && off + 4 <= len)
+		h ^= ((p[off] << 8) | p[off + 1]) ^ ((p[off + 2] << 8) | p[off + 3]);
+	h ^= proto;
+	/* Consumers are chosen by the low bits */
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Largest frame of the pools, enough for a packet of a usual MTU. Larger
+ * ones, e.g. GSO packets, are allocated on their own. */
+#define SNIFFER_SLAB_FRAME_LEN 2048
+
+/* Frames carved out of a single allocation. Only the reader of a queue
+ * takes frames from its pool, while the consumers give them back through
+ * a stack that the reader empties all at once, which is not subject to
+ * ABA. The reader allocates frames on its own once the pool is exhausted.
+ */
+class SnifferPool {
+	unsigned char *slab;
+	SnifferFrame *frames;
+	/* Only used by the reader */
+	SnifferFrame *free_list;
+	std::atomic<SnifferFrame*> returned;
+
+public:
+	explicit SnifferPool(size_t n) : free_list(NULL), returned(NULL)
+	{
+		slab = new unsigned char[n * SNIFFER_SLAB_FRAME_LEN];
+		frames = new SnifferFrame[n];
+		for (size_t i = 0; i < n; ++i) {
+			frames[i].data = slab + i * SNIFFER_SLAB_FRAME_LEN;
+			frames[i].pool = this;
+			frames[i].next = i + 1 < n ? &frames[i + 1] : NULL;
+		}
+		free_list = n ? frames : NULL;
+	}
+
+	~SnifferPool()
+	{
+		delete[] frames;
+		delete[] slab;
+	}
+
+	/* A frame holding len bytes, called by the reader */
+	SnifferFrame *get(size_t len)
+	{
+		SnifferFrame *f;
+
+		if (len <= SNIFFER_SLAB_FRAME_LEN) {
+			if (!free_list)
+				free_list = returned.exchange(NULL,
+						std::memory_order_acquire);
+			if ((f = free_list)) {
+				free_list = f->next;
+				return f;
+			}
+		}
+		f = new SnifferFrame;
+		f->data = new unsigned char[len];
+		f->pool = NULL;
+		return f;
+	}
+
+	/* Called from any thread */
+	static void put(SnifferFrame *f)
+	{
+		SnifferPool *p = f->pool;
+
+		if (!p) {
+			delete[] f->data;
+			delete f;
+			return;
+		}
+		f->next = p->returned.load(std::memory_order_relaxed);
+		while (!p->returned.compare_exchange_weak(f->next, f,
+					std::memory_order_release, std::memory_order_relaxed))
+			;
+	}
+};
+
+/* Fills a SnifferHistogram from the threads of the consumers */
+class SnifferTimer {
+	std::atomic<uint64_t> buckets[SNIFFER_HIST_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+
+public:
+	SnifferTimer() : count(0), sum(0), max(0)
+	{
+		for (size_t i = 0; i < SNIFFER_HIST_BUCKETS; ++i)
+			buckets[i] = 0;
+	}
+
+	void add(int64_t ns)
+	{
+		uint64_t d = ns > 0 ? ns : 0;
+		uint64_t m = max.load(std::memory_order_relaxed);
+		size_t b = d ? 63 - __builtin_clzll(d) : 0;
+
+		buckets[std::min(b, (size_t)SNIFFER_HIST_BUCKETS - 1)].fetch_add(1,
+				std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(d, std::memory_order_relaxed);
+		while (d > m && !max.compare_exchange_weak(m, d,
+					std::memory_order_relaxed))
+			;
+	}
+
+	/* Consistent enough for statistics, the counters are not read at
+	 * once */
+	void read(SnifferHistogram *h) const
+	{
+		for (size_t i = 0; i < SNIFFER_HIST_BUCKETS; ++i)
+			h->buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		h->count = count.load(std::memory_order_relaxed);
+		h->sum = sum.load(std::memory_order_relaxed);
+		h->max = max.load(std::memory_order_relaxed);
+	}
+};
+
+/* Absolute deadline on CLOCK_MONOTONIC after the relative timeout t */
+static void deadline_after(const struct timespec *t, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += t->tv_sec + (deadline->tv_nsec + t->tv_nsec) /
+		1000000000L;
+	deadline->tv_nsec = (deadline->tv_nsec + t->tv_nsec) % 1000000000L;
+}
+
+/* Timeout for poll() until the deadline, rounded up, -1 if there is no
+ * deadline. Returns false once it has passed. */
+static bool poll_timeout(const struct timespec *deadline, int *timeout)
+{
+	struct timespec now;
+
+	*timeout = -1;
+	if (!deadline)
+		return true;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > deadline->tv_sec ||
+			(now.tv_sec == deadline->tv_sec &&
+			 now.tv_nsec >= deadline->tv_nsec))
+		return false;
+	*timeout = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000 + 1;
+	return true;
+}
+
+/* Packets delivered to one consumer thread */
+struct SnifferConsumer {
+	/* One ring per queue, as each ring has a single producer */
+	std::vector<SPSCRing<SnifferFrame*> *> rings;
+	/* Ring to read first, so that no queue is starved */
+	size_t next = 0;
+	/* Signaled once per read that delivered packets to this consumer,
+	 * and when the sniffer stops */
+	int efd;
+
+	SnifferConsumer(size_t queues, size_t ring_size)
+	{
+		if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+			_crash("Failed to init eventfd for the Sniffer");
+		for (size_t i = 0; i < queues; ++i)
+			rings.push_back(new SPSCRing<SnifferFrame*>(ring_size));
+	}
+
+	~SnifferConsumer()
+	{
+		SnifferFrame *f;
+
+		for (SPSCRing<SnifferFrame*> *r : rings) {
+			while (r->pop(&f))
+				TbxSniffer::release(f);
+			delete r;
+		}
+		close(efd);
+	}
+
+	void signal()
+	{
+		uint64_t one = 1;
+
+		if (write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			_crash("Sniffer::signal::write");
+	}
+
+	bool empty() const
+	{
+		for (SPSCRing<SnifferFrame*> *r : rings)
+			if (!r->empty())
+				return false;
+		return true;
+	}
+
+	/* Forget the pending wakeups */
+	void clear()
+	{
+		uint64_t count;
+
+		if (read(efd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+			_crash("Sniffer::clear::read");
+	}
+
+	bool pop(SnifferFrame **f)
+	{
+		for (size_t i = 0; i < rings.size(); ++i) {
+			size_t r = (next + i) % rings.size();
+
+			if (rings[r]->pop(f)) {
+				next = (r + 1) % rings.size();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/* Wait to be signaled until the deadline, if any */
+	bool wait(const struct timespec *deadline)
+	{
+		struct pollfd pfd = { efd, POLLIN, 0 };
+		int timeout, err;
+
+		if (!poll_timeout(deadline, &timeout))
+			return false;
+		if ((err = poll(&pfd, 1, timeout)) == -1 && errno != EINTR)
+			_crash("Sniffer::wait::poll");
+		if (err > 0)
+			clear();
+		return true;
+	}
+};
+
+struct Sniffer_private;
+class SnifferReactor;
+
+/* A NFQUEUE queue, or a packet socket */
+struct SnifferQueue {
+	Sniffer_private *d;
+	/* Position of the queue in Sniffer_private::queues */
+	size_t index;
+	/* Reading the queue while the sniffer is started */
+	SnifferReactor *reactor = NULL;
+	/* Socket polled by the reactor */
+	int fd = -1;
+	/* SNIFFER_PACKET ring of blocks, and the block to read next */
+	unsigned char *map = NULL;
+	size_t block = 0;
+	struct nfq_handle *h = NULL;
+	struct nfq_q_handle *qh = NULL;
+	/* Packets delivered to each consumer since it was last signaled */
+	std::vector<size_t> queued;
+	/* ID of the last packet waiting for its verdict */
+	uint32_t last_id = 0;
+	bool pending = false;
+	/* Enough frames to fill the rings of all the consumers */
+	SnifferPool pool;
+	/* Packets read from the queue, only written by its reader */
+	std::atomic<uint64_t> received;
+
+	SnifferQueue(Sniffer_private *d, size_t index, size_t consumers,
+			size_t ring_size)
+		: d(d), index(index), queued(consumers, 0),
+		pool(consumers * ring_size), received(0) {}
+
+	/* Copy a packet out of the kernel buffers */
+	SnifferFrame *frame(const unsigned char *data, size_t len,
+			uint16_t lltype, const struct timespec &ts)
+	{
+		SnifferFrame *f = pool.get(len);
+
+		memcpy(f->data, data, len);
+		f->len = len;
+		f->lltype = lltype;
+		f->ts = ts;
+		return f;
+	}
+
+	/* Drop all the packets up to the last one in a single message */
+	void flush_verdicts()
+	{
+		if (!pending)
+			return;
+		pending = false;
+		if (nfq_set_verdict_batch(qh, last_id, NF_DROP) < 0)
+			_crash("error during nfq_set_verdict_batch()");
+	}
+};
+
 struct Sniffer_private {
 	static int next_q;
 
+	/* Number of the first queue */
 	int q;
+	SnifferConfig config;
 	std::vector<std::string> key;
-	pthread_t thread = 0;
-	sem_t full;
-	pthread_mutex_t mutex;
-	std::queue<Crafter::Packet*> packets;
+	/* The key only uses the options understood by NFTRules */
+	bool parsed;
+	/* Set when the rule is installed through nftables rather than by
+	 * running iptables */
+	bool native;
+	NFTMatch match;
+	std::vector<SnifferQueue *> queues;
+	std::vector<SnifferConsumer *> consumers;
+	/* Reactors of the queues that do not use the shared one */
+	std::vector<SnifferReactor *> reactors;
+	std::atomic<uint64_t> dropped;
+	/* Netlink messages lost as the socket buffer overran */
+	std::atomic<uint64_t> overruns;
+	/* Set by set_filter() */
+	std::atomic<peek_handler> filter;
+	void *filter_ctx;
+	/* Frames discarded by the filter */
+	std::atomic<uint64_t> filtered;
+	SnifferTimer decode_time;
+	SnifferTimer callback_time;
 
 	void *ctx = NULL;
-	bool sniff;
-	struct sigaction old_sa;
+	/* Packets are read, cleared by halt() */
+	std::atomic<bool> sniff;
+	/* Between start() and stop() */
+	bool started;
 
-	Sniffer_private(const std::vector<const char*> &k)
-		: q(next_q), sniff(false)
+	Sniffer_private(const std::vector<const char*> &k,
+			const SnifferConfig &c)
+		: q(next_q), config(c), dropped(0), overruns(0),
+		filter(NULL), filter_ctx(NULL), filtered(0), sniff(false),
+		started(false)
 	{
-		int err;
-
-		memset(&old_sa, 0, sizeof(old_sa));
-		if (sem_init(&full, 0, 0) == -1)
-			_crash("Failed to init semaphore for the Sniffer");
-		if ((err = pthread_mutex_init(&mutex, NULL))) {
-			errno = err;
-			_crash("Failed to init mutex for the Sniffer");
-		}
+		if (!config.queues)
+			config.queues = 1;
+		if (!config.consumers)
+			config.consumers = 1;
+		for (size_t i = 0; i < config.queues; ++i)
+			queues.push_back(new SnifferQueue(this, i, config.consumers,
+						config.ring_size));
+		for (size_t i = 0; i < config.consumers; ++i)
+			consumers.push_back(new SnifferConsumer(config.queues,
+						config.ring_size));
 
 		key.reserve(k.size() + 6);
 		std::vector<const char*>::const_iterator it;
 		for (it = k.begin(); it != k.end(); ++it)
 			key.push_back(std::string(*it));
+		parsed = NFTRules::ParseMatch(key, &match);
+		if (config.backend == SNIFFER_PACKET && !parsed)
+			_crash("The key cannot be turned into a BPF filter");
+		native = parsed && config.backend == SNIFFER_NFQUEUE &&
+			NFTRules::Get();
 		key.push_back("-j");
 		key.push_back("NFQUEUE");
-		key.push_back("--queue-num");
-		key.push_back(std::to_string(q));
+		if (config.queues == 1) {
+			key.push_back("--queue-num");
+			key.push_back(std::to_string(q));
+		} else {
+			/* The kernel spreads the flows over the queues */
+			key.push_back("--queue-balance");
+			key.push_back(std::to_string(q) + ":" +
+					std::to_string(q + config.queues - 1));
+		}
 		key.push_back("-I");
 		key.push_back("INPUT");
-		++next_q;
+		next_q += config.queues;
 	}
 
 	~Sniffer_private()
 	{
-		sem_destroy(&full);
-		pthread_cancel(thread);
-		pthread_mutex_destroy(&mutex);
+		/* Gives the frames left in the rings back to the pools */
+		for (SnifferConsumer *c : consumers)
+			delete c;
+		for (SnifferQueue *sq : queues)
+			delete sq;
+	}
+
+	/* Stop reading the packets, and wake up the consumers */
+	void halt()
+	{
+		sniff = false;
+		for (SnifferConsumer *c : consumers)
+			c->signal();
 	}
 
 	int add_rule()
 	{
+		if (config.backend == SNIFFER_PACKET)
+			return 0;
+		if (native)
+			return NFTRules::Get()->AddQueue(match, q, config.queues) ?
+				0 : -1;
 		key[key.size() - 2] = "-I";
 		return iptables(key);
 	}
 
 	int remove_rule()
 	{
+		if (config.backend == SNIFFER_PACKET)
+			return 0;
+		if (native)
+			return NFTRules::Get()->RemoveQueue(q) ? 0 : -1;
 		key[key.size() - 2] = "-D";
 		return iptables(key);
 	}
 
+	/* Called by the reader of sq for each packet */
+	void enqueue(SnifferQueue *sq, SnifferFrame *f, uint32_t hash)
+	{
+		size_t c = consumers.size() > 1 ? hash % consumers.size() : 0;
+		SPSCRing<SnifferFrame*> *ring = consumers[c]->rings[sq->index];
+		SnifferFrame *old;
+
+		sq->received.store(sq->received.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+		if (config.overflow == SNIFFER_DROP_OLDEST) {
+			if (ring->push_evict(f, &old)) {
+				++dropped;
+				TbxSniffer::release(old);
+			}
+			++sq->queued[c];
+			return;
+		}
+		while (!ring->push(f)) {
+			if (config.overflow == SNIFFER_DROP_NEWEST || !sniff ||
+					_killed) {
+				++dropped;
+				TbxSniffer::release(f);
+				return;
+			}
+			/* Make sure the consumer is draining the ring */
+			signal(sq);
+			usleep(SNIFFER_BLOCK_WAIT_US);
+		}
+		++sq->queued[c];
+	}
+
+	/* Wake up the consumers to which sq delivered packets */
+	void signal(SnifferQueue *sq)
+	{
+		for (size_t c = 0; c < consumers.size(); ++c) {
+			if (!sq->queued[c])
+				continue;
+			sq->queued[c] = 0;
+			consumers[c]->signal();
+		}
+	}
+
+	void open_queue(SnifferQueue *sq)
+	{
+		if (config.backend == SNIFFER_PACKET)
+			open_packet(sq);
+		else
+			open_nfqueue(sq);
+	}
+
+	void open_nfqueue(SnifferQueue *sq);
+	void open_packet(SnifferQueue *sq);
+	void attach_filter(int fd);
+	void close_queue(SnifferQueue *sq);
+
 	static int nfq_cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
               struct nfq_data *nfa, void *data);
 };
 int Sniffer_private::next_q = 0;
 
+void Sniffer_private::open_nfqueue(SnifferQueue *sq)
+{
+	sq->h = nfq_open();
+	if (!sq->h)
+		_crash("error during nfq_open()");
+	sq->fd = nfq_fd(sq->h);
+
+	/* The handler of the queues is global to the protocol family */
+	if (!sq->index && (nfq_unbind_pf(sq->h, AF_INET) < 0 ||
+				nfq_unbind_pf(sq->h, AF_INET6) < 0))
+		_crash("error during nfq_unbind_pf()");
+
+	if (nfq_bind_pf(sq->h, AF_INET) < 0 || nfq_bind_pf(sq->h, AF_INET6) < 0)
+		_crash("error during nfq_bind_pf()");
+
+	sq->qh = nfq_create_queue(sq->h, q + sq->index, &Sniffer_private::nfq_cb,
+			sq);
+	if (!sq->qh)
+		_crash("error during nfq_create_queue()");
+
+	if (nfq_set_mode(sq->qh, NFQNL_COPY_PACKET, 0xffff) < 0)
+		_crash("can't set packet_copy mode");
+
+	if (config.fail_open && nfq_set_queue_flags(sq->qh, NFQA_CFG_F_FAIL_OPEN,
+				NFQA_CFG_F_FAIL_OPEN) < 0)
+		_crash("can't set the queue in fail-open mode");
+	/* Receive GSO packets as such rather than having the kernel segment
+	 * them, which older kernels do not support */
+	nfq_set_queue_flags(sq->qh, NFQA_CFG_F_GSO, NFQA_CFG_F_GSO);
+
+	/* The kernel only timestamps the packets as they are received, which
+	 * NFQUEUE then reports, once a socket asks for timestamps */
+	int on = 1;
+	if (setsockopt(sq->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+		_crash("can't enable the timestamping of the packets");
+
+	if (config.rcvbuf) {
+		int fd = sq->fd, size = config.rcvbuf;
+
+		/* Go past rmem_max, as we are privileged anyway */
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+					sizeof(size)) < 0 &&
+				setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size,
+					sizeof(size)) < 0)
+			_crash("can't set the size of the netlink buffer");
+	}
+}
+
+/* pcap filter expression selecting the packets matched by m */
+static std::string bpf_expression(const NFTMatch &m)
+{
+	std::string expr, proto = std::to_string(m.proto);
+
+	switch (m.proto) {
+	case -1:
+		break;
+	case IPPROTO_TCP:
+		expr = "tcp";
+		break;
+	case IPPROTO_UDP:
+		expr = "udp";
+		break;
+	case IPPROTO_ICMP:
+		expr = "icmp";
+		break;
+	case IPPROTO_ICMPV6:
+		expr = "icmp6";
+		break;
+	default:
+		expr = "(ip proto " + proto + " or ip6 proto " + proto + ")";
+	}
+	/* Ports always come with TCP or UDP */
+	if (m.sport >= 0)
+		expr += " and src port " + std::to_string(m.sport);
+	if (m.dport >= 0)
+		expr += " and dst port " + std::to_string(m.dport);
+	return expr;
+}
+
+void Sniffer_private::attach_filter(int fd)
+{
+	std::string expr = bpf_expression(match);
+	struct bpf_program prog;
+	struct sock_fprog fprog;
+	pcap_t *p;
+
+	if (expr.empty())
+		return;
+	/* SOCK_DGRAM packet sockets filter from the network header */
+	if (!(p = pcap_open_dead(DLT_RAW, 0xffff)))
+		_crash("pcap_open_dead");
+	if (pcap_compile(p, &prog, expr.c_str(), 1, PCAP_NETMASK_UNKNOWN) < 0) {
+		std::cerr << expr << ": " << pcap_geterr(p) << std::endl;
+		_crash("can't compile the BPF filter");
+	}
+	/* Classic BPF, in the same layout for libpcap and the kernel */
+	fprog.len = prog.bf_len;
+	fprog.filter = (struct sock_filter *)prog.bf_insns;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+				sizeof(fprog)) < 0)
+		_crash("can't attach the BPF filter");
+	pcap_freecode(&prog);
+	pcap_close(p);
+}
+
+void Sniffer_private::open_packet(SnifferQueue *sq)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	int v = TPACKET_V3;
+
+	/* Bound to no protocol until the filter is attached, so that nothing
+	 * else gets in the ring */
+	if ((sq->fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		_crash("can't open the packet socket");
+	attach_filter(sq->fd);
+
+	if (setsockopt(sq->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0)
+		_crash("TPACKET_V3 is not supported");
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = SNIFFER_BLOCK_SIZE;
+	req.tp_block_nr = SNIFFER_BLOCK_NR;
+	req.tp_frame_size = SNIFFER_FRAME_SIZE;
+	req.tp_frame_nr = SNIFFER_BLOCK_SIZE / SNIFFER_FRAME_SIZE *
+		SNIFFER_BLOCK_NR;
+	req.tp_retire_blk_tov = SNIFFER_BLOCK_TIMEOUT_MS;
+	if (setsockopt(sq->fd, SOL_PACKET, PACKET_RX_RING, &req,
+				sizeof(req)) < 0)
+		_crash("can't set up the packet ring");
+	sq->map = (unsigned char *)mmap(NULL,
+			SNIFFER_BLOCK_SIZE * SNIFFER_BLOCK_NR, PROT_READ | PROT_WRITE,
+			MAP_SHARED, sq->fd, 0);
+	if (sq->map == MAP_FAILED) {
+		sq->map = NULL;
+		_crash("can't map the packet ring");
+	}
+#ifdef PACKET_IGNORE_OUTGOING
+	/* Older kernels lack it, the reader then skips these packets */
+	v = 1;
+	setsockopt(sq->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &v, sizeof(v));
+#endif
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	if (!config.iface.empty() &&
+			!(sll.sll_ifindex = if_nametoindex(config.iface.c_str())))
+		_crash("unknown interface for the Sniffer");
+	if (bind(sq->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		_crash("can't bind the packet socket");
+
+	if (queues.size() > 1) {
+		/* As --queue-balance, the kernel hashes both directions of a flow
+		 * to the same socket */
+		v = ((getpid() + q) & 0xffff) | (PACKET_FANOUT_HASH << 16);
+		if (setsockopt(sq->fd, SOL_PACKET, PACKET_FANOUT, &v,
+					sizeof(v)) < 0)
+			_crash("can't join the packet fanout group");
+	}
+}
+
+void Sniffer_private::close_queue(SnifferQueue *sq)
+{
+	if (sq->h) {
+		nfq_destroy_queue(sq->qh);
+		nfq_close(sq->h);
+		sq->h = NULL;
+		sq->qh = NULL;
+	} else {
+		if (sq->map)
+			munmap(sq->map, SNIFFER_BLOCK_SIZE * SNIFFER_BLOCK_NR);
+		sq->map = NULL;
+		close(sq->fd);
+	}
+	sq->fd = -1;
+}
+
 int Sniffer_private::nfq_cb(struct nfq_q_handle *qh,
 		struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data)
 {
 	(void)nfmsg;
-	Sniffer_private *s = static_cast<Sniffer_private*>(data);
+	SnifferQueue *sq = static_cast<SnifferQueue*>(data);
 	nfqnl_msg_packet_hdr *header;
 	uint32_t id = 0;
 	uint16_t lltype = 0;
-	int len, err;
+	int len;
 	unsigned char *payload;
+	struct timeval tv;
+	struct timespec ts;
 
 	if (!(header = nfq_get_msg_packet_hdr(nfa)))
 		return nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
@@ -156,175 +813,621 @@ int Sniffer_private::nfq_cb(struct nfq_q_handle *qh,
 	id = ntohl(header->packet_id);
 	lltype = ntohs(header->hw_protocol);
 
-  	if ((len = nfq_get_payload(nfa, &payload))) {
-		Crafter::Packet *p = new Crafter::Packet(payload, len, lltype);
-		if ((err = pthread_mutex_lock(&s->mutex))) {
-			errno = err;
-			_crash("sniffer::nfq_cb::mutex_lock");
-		}
-		s->packets.push(p);
-		if (sem_post(&s->full))
-		 /* Maximum semaphore value exceeded,
-		  * reduce the queue to preserve integrity (=DROP packet)... */
-			s->packets.pop();
-		if ((err = pthread_mutex_unlock(&s->mutex))) {
-			errno = err;
-			_crash("sniffer::nfq_cb::mutex_unlock");
-		}
+  	if ((len = nfq_get_payload(nfa, &payload)) > 0) {
+		/* Missing if the packet was queued before timestamps were
+		 * enabled */
+		if (nfq_get_timestamp(nfa, &tv))
+			clock_gettime(CLOCK_REALTIME, &ts);
+		else
+			ts = { tv.tv_sec, tv.tv_usec * 1000 };
+		sq->d->enqueue(sq, sq->frame(payload, len, lltype, ts),
+				sq->d->consumers.size() > 1 ? flow_hash(payload, len) : 0);
 	}
-	return nfq_set_verdict(qh, id, NF_DROP, 0, NULL);
+	/* The verdict is issued by flush_verdicts() */
+	sq->last_id = id;
+	sq->pending = true;
+	return 0;
 }
 
-TbxSniffer::TbxSniffer(const std::vector<const char*> &k)
-	: d(new Sniffer_private(k)) {}
+TbxSniffer::TbxSniffer(const std::vector<const char*> &k,
+		const SnifferConfig &config)
+	: d(new Sniffer_private(k, config)) {}
 
 TbxSniffer::~TbxSniffer()
 {
-	if (d->sniff) {
-		d->sniff = false;
-		pthread_join(d->thread, NULL);
-		sigaction(SIGINT, &d->old_sa, NULL);
-	}
+	stop();
 	delete d;
 }
 
-void TbxSniffer::stop()
+/* Drain the netlink socket, up to a batch of messages */
+static void read_messages(SnifferQueue *sq, char *buf)
+{
+	Sniffer_private *d = sq->d;
+
+	for (int n = 0; n < SNIFFER_VERDICT_BATCH; ++n) {
+		ssize_t rv = recv(sq->fd, buf, SNIFFER_RECV_BUF_LEN, MSG_DONTWAIT);
+
+		if (rv > 0) {
+			nfq_handle_packet(sq->h, buf, rv);
+		} else if (rv < 0 && errno == ENOBUFS) {
+			/* The kernel dropped messages, keep reading */
+			++d->overruns;
+		} else if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		} else {
+			d->halt();
+			break;
+		}
+	}
+	sq->flush_verdicts();
+}
+
+/* Deliver the packets of the blocks that the kernel handed over, and give
+ * the blocks back */
+static void read_blocks(SnifferQueue *sq)
 {
-	d->sniff = false;
-	pthread_join(d->thread, NULL);
-	sigaction(SIGINT, &d->old_sa, NULL);
+	Sniffer_private *d = sq->d;
+	struct tpacket_stats_v3 stats;
+	socklen_t len = sizeof(stats);
+
+	for (int n = 0; n < SNIFFER_BLOCK_NR; ++n) {
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+			(sq->map + sq->block * SNIFFER_BLOCK_SIZE);
+		struct tpacket3_hdr *ppd;
+
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+						__ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+		ppd = (struct tpacket3_hdr *)((unsigned char *)bd +
+				bd->hdr.bh1.offset_to_first_pkt);
+		for (uint32_t i = 0; i < bd->hdr.bh1.num_pkts; ++i) {
+			const struct sockaddr_ll *sll = (const struct sockaddr_ll *)
+				((unsigned char *)ppd +
+				 TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			unsigned char *payload = (unsigned char *)ppd + ppd->tp_mac;
+			struct timespec ts = { ppd->tp_sec, ppd->tp_nsec };
+
+			/* INPUT never sees them either */
+			if (sll->sll_pkttype != PACKET_OUTGOING)
+				d->enqueue(sq, sq->frame(payload, ppd->tp_snaplen,
+							ntohs(sll->sll_protocol), ts),
+						d->consumers.size() > 1 ?
+						flow_hash(payload, ppd->tp_snaplen) : 0);
+			ppd = (struct tpacket3_hdr *)((unsigned char *)ppd +
+					ppd->tp_next_offset);
+		}
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				__ATOMIC_RELEASE);
+		sq->block = (sq->block + 1) % SNIFFER_BLOCK_NR;
+	}
+	/* Packets the kernel could not store in the ring since the last call */
+	if (!getsockopt(sq->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len))
+		d->overruns += stats.tp_drops;
 }
 
-static void* _start_queue(void *v)
+/* Largest number of ready sockets handled per epoll_wait() */
+#define SNIFFER_MAX_EVENTS 64
+
+/* An epoll loop, in a thread of its own, reading the queues of any number
+ * of sniffers and dispatching their packets to the rings of the consumers.
+ * Sniffers with a single queue all share one reactor, while the queues of
+ * the others, which want to spread the load over several CPUs, each get a
+ * reactor of their own.
+ */
+class SnifferReactor {
+	int epfd;
+	/* Wakes the loop up when the reactor is destroyed */
+	int wake_fd;
+	int cpu;
+	std::thread thread;
+	/* Held while dispatching the packets, so that a queue can only be
+	 * removed between two batches */
+	std::mutex lock;
+	std::set<SnifferQueue *> queues;
+	std::atomic<bool> quit;
+
+	void run();
+	/* Called with the lock held */
+	void unregister(SnifferQueue *sq);
+
+public:
+	/* The thread of the reactor is pinned to cpu, unless it is negative */
+	explicit SnifferReactor(int cpu = -1) : cpu(cpu), quit(false)
+	{
+		struct epoll_event ev;
+
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+			_crash("Sniffer::epoll_create");
+		if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+			_crash("Failed to init eventfd for the Sniffer");
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+			_crash("Sniffer::epoll_ctl");
+	}
+
+	~SnifferReactor()
+	{
+		uint64_t one = 1;
+
+		quit = true;
+		if (thread.joinable()) {
+			if (write(wake_fd, &one, sizeof(one)) == -1)
+				_crash("Sniffer::reactor::write");
+			thread.join();
+		}
+		close(wake_fd);
+		close(epfd);
+	}
+
+	/* Start reading sq, starting the thread if needed */
+	void add(SnifferQueue *sq);
+
+	/* Once it returns, sq is no longer read */
+	void remove(SnifferQueue *sq);
+
+	static SnifferReactor *shared()
+	{
+		static SnifferReactor reactor;
+
+		return &reactor;
+	}
+};
+
+void SnifferReactor::add(SnifferQueue *sq)
 {
-	Sniffer_private *d = static_cast<Sniffer_private*>(v);
-	int rv, fd, err;
-	struct nfq_handle *h;
-	struct nfq_q_handle *qh;
-	char buf[4096] __attribute__ ((aligned));
+	std::lock_guard<std::mutex> guard(lock);
+	struct epoll_event ev;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int err;
 
-	h = nfq_open();
-	if (!h)
-		_crash("error during nfq_open()");
+	ev.events = EPOLLIN;
+	ev.data.ptr = sq;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sq->fd, &ev) == -1)
+		_crash("Sniffer::epoll_ctl");
+	queues.insert(sq);
+	sq->reactor = this;
+	if (thread.joinable())
+		return;
 
-	if (nfq_unbind_pf(h, AF_INET) < 0 || nfq_unbind_pf(h, AF_INET6) < 0)
-		_crash("error during nfq_unbind_pf()");
+	thread = std::thread(&SnifferReactor::run, this);
+	if (cpu >= 0 && cpus > 0) {
+		cpu_set_t set;
 
-	if (nfq_bind_pf(h, AF_INET) < 0 || nfq_bind_pf(h, AF_INET6) < 0)
-		_crash("error during nfq_bind_pf()");
+		CPU_ZERO(&set);
+		CPU_SET(cpu % cpus, &set);
+		if ((err = pthread_setaffinity_np(thread.native_handle(),
+						sizeof(set), &set))) {
+			errno = err;
+			_crash("Cannot pin the Sniffer queue to a CPU");
+		}
+	}
+}
 
-	qh = nfq_create_queue(h,  d->q, &Sniffer_private::nfq_cb, d);
-	if (!qh)
-		_crash("error during nfq_create_queue()");
+void SnifferReactor::unregister(SnifferQueue *sq)
+{
+	if (!queues.erase(sq))
+		return;
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, sq->fd, NULL) == -1)
+		_crash("Sniffer::epoll_ctl");
+}
 
-	if (nfq_set_mode(qh, NFQNL_COPY_PACKET, 0xffff) < 0)
-		_crash("can't set packet_copy mode");
+void SnifferReactor::remove(SnifferQueue *sq)
+{
+	std::lock_guard<std::mutex> guard(lock);
 
-	fd = nfq_fd(h);
+	unregister(sq);
+	sq->reactor = NULL;
+}
 
-	if (d->add_rule())
-		_crash("The call to iptables failed!");
+void SnifferReactor::run()
+{
+	char *buf = new char[SNIFFER_RECV_BUF_LEN];
+	struct epoll_event events[SNIFFER_MAX_EVENTS];
+	int n;
 
-	fd_set set;
-	FD_ZERO(&set);
-	do {
-		struct timeval tv = { 1, 0 };
-		FD_SET(fd, &set);
-		err = select(fd+1, &set, NULL, NULL, &tv);
-		if (!err)
+	while (!quit) {
+		/* Interrupted by SIGINT, whether SA_RESTART is set or not */
+		if ((n = epoll_wait(epfd, events, SNIFFER_MAX_EVENTS, 1000)) == -1) {
+			if (errno == EINTR)
+				n = 0;
+			else
+				_crash("Sniffer::epoll_wait");
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (_killed) {
+			/* Until the sniffers are stopped */
+			while (!queues.empty()) {
+				SnifferQueue *sq = *queues.begin();
+
+				sq->d->halt();
+				unregister(sq);
+			}
 			continue;
-		if (err > 0)
-			rv = recv(fd, buf, sizeof(buf), 0);
-		else
-			break;
-		if (rv > 0)
-			nfq_handle_packet(h, buf, rv);
-		else
-			break;
+		}
+		for (int i = 0; i < n; ++i) {
+			SnifferQueue *sq = static_cast<SnifferQueue*>(events[i].data.ptr);
+
+			/* The wakeup of the destructor, or a queue removed after
+			 * epoll_wait() returned */
+			if (!sq || !queues.count(sq) || !sq->d->sniff)
+				continue;
+			if (sq->h)
+				read_messages(sq, buf);
+			else
+				read_blocks(sq);
+			/* A single wakeup for all the packets of this batch */
+			sq->d->signal(sq);
+		}
 	}
-	while (d->sniff && !_killed);
+	delete[] buf;
+}
 
-	if(d->remove_rule())
-		_crash("Failed to remove the iptables rule");
+/* The SIGINT handler is shared by all the started sniffers */
+static std::mutex sigint_lock;
+static size_t sigint_users;
+static struct sigaction sigint_old;
 
-	d->sniff = false;
-	sem_post(&d->full);
+static void sigint_hold()
+{
+	std::lock_guard<std::mutex> guard(sigint_lock);
+	struct sigaction sa;
 
-	nfq_destroy_queue(qh);
-	nfq_close(h);
+	if (sigint_users++)
+		return;
+	sa.sa_handler = _sig_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, &sigint_old) == -1)
+		_crash("Cannot register a SIGINT handler");
+}
+
+static void sigint_release()
+{
+	std::lock_guard<std::mutex> guard(sigint_lock);
+
+	if (!--sigint_users)
+		sigaction(SIGINT, &sigint_old, NULL);
+}
+
+void TbxSniffer::stop()
+{
+	if (!d->started)
+		return;
+
+	d->halt();
+	for (SnifferQueue *sq : d->queues)
+		if (sq->reactor)
+			sq->reactor->remove(sq);
+	for (SnifferReactor *r : d->reactors)
+		delete r;
+	d->reactors.clear();
+
+	if (d->remove_rule())
+		_crash("Failed to remove the sniffer rule");
+	for (SnifferQueue *sq : d->queues)
+		d->close_queue(sq);
+	sigint_release();
+	d->started = false;
+}
+
+/* Run the handler of the packet, accounting for its duration */
+static int timed_call(Sniffer_private *d, rcv_handler h, Crafter::Packet *p)
+{
+	int64_t start = monotonic_ns();
+	int ret = h(p, d->ctx);
 
-	pthread_exit(0);
+	d->callback_time.add(monotonic_ns() - start);
+	return ret;
 }
 
 int TbxSniffer::start(rcv_handler h, void *ctx)
 {
+	std::vector<std::thread> workers;
+
 	start();
 
 	d->ctx = ctx;
+	/* The first consumer runs in the calling thread */
+	for (size_t c = 1; c < d->consumers.size(); ++c)
+		workers.push_back(std::thread([this, h, c]() {
+			while (d->sniff && !_killed) {
+				struct timespec t = { 1, 0 };
+				Crafter::Packet *p = recv(&t, c);
+				if (p && timed_call(d, h, p))
+					d->halt();
+			}
+		}));
 	while (d->sniff && !_killed) {
 		struct timespec t = { 1, 0 };
 		Crafter::Packet *p = recv(&t);
 		if (!p)
 			continue;
-		if (h(p, d->ctx)) {
-			d->sniff = false;
-		}
+		if (timed_call(d, h, p))
+			d->halt();
 	}
+	for (std::thread &w : workers)
+		w.join();
+	stop();
 
 	return 0;
 }
 
 int TbxSniffer::start()
 {
-	int err;
+	/* Sniffers spreading their load get their own threads, as do the
+	 * ones that may block the reactor until their consumer catches up */
+	bool shared = d->queues.size() == 1 && d->config.cpu < 0 &&
+		d->config.overflow != SNIFFER_BLOCK;
 
-	if (d->sniff)
+	if (d->started)
 		_crash("The Sniffer is already started!");
 
+	sigint_hold();
+	/* All the queues must be bound before the rule spreads packets */
+	for (SnifferQueue *sq : d->queues)
+		d->open_queue(sq);
+	if (d->add_rule())
+		_crash("Failed to add the sniffer rule");
 
-	struct sigaction sa;
-	sa.sa_handler = _sig_handler;
-	sa.sa_flags = SA_RESTART;
-	sigemptyset(&sa.sa_mask);
-	if (sigaction(SIGINT, &sa, &d->old_sa) == -1)
-		_crash("Cannot register a SIGINT handler");
+	d->sniff = true;
+	d->started = true;
+	for (SnifferQueue *sq : d->queues) {
+		SnifferReactor *r = SnifferReactor::shared();
 
-	if ((err = pthread_create(&d->thread, NULL, _start_queue, d))) {
-		errno = err;
-		_crash("Cannot start thread for Sniffer queue");
+		if (!shared) {
+			r = new SnifferReactor(d->config.cpu < 0 ? -1 :
+					d->config.cpu + sq->index);
+			d->reactors.push_back(r);
+		}
+		r->add(sq);
 	}
-
-	d->sniff = true;
 	return 0;
 }
 
-Crafter::Packet* TbxSniffer::recv(struct timespec *t)
+int TbxSniffer::wait(const std::vector<TbxSniffer*> &sniffers,
+		struct timespec *t)
 {
-	int err;
-	if (t) {
-		if (sem_timedwait(&d->full, t) == -1) {
-			if (errno == ETIMEDOUT)
-				return NULL;
-			else
-				_crash("Sniffer::recv::sem_trywait");
+	std::vector<struct pollfd> pfds(sniffers.size());
+	struct timespec deadline;
+	int timeout, n;
+
+	if (t)
+		deadline_after(t, &deadline);
+	for (;;) {
+		for (size_t i = 0; i < sniffers.size(); ++i) {
+			Sniffer_private *d = sniffers[i]->d;
+
+			if (!d->sniff || !d->consumers[0]->empty())
+				return i;
+			pfds[i].fd = d->consumers[0]->efd;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
 		}
-	} else {
-		if (sem_wait(&d->full) == -1)
-			_crash("Sniffer::recv::sem_wait");
+		if (!poll_timeout(t ? &deadline : NULL, &timeout))
+			return -1;
+		if ((n = poll(pfds.data(), pfds.size(), timeout)) == -1 &&
+				errno != EINTR)
+			_crash("Sniffer::wait::poll");
+		for (size_t i = 0; n > 0 && i < sniffers.size(); ++i)
+			if (pfds[i].revents)
+				sniffers[i]->d->consumers[0]->clear();
+	}
+}
+
+/* Decode a frame, accounting for the time it takes */
+static Crafter::Packet *timed_decode(Sniffer_private *d, SnifferFrame *f)
+{
+	int64_t start = monotonic_ns();
+	Crafter::Packet *p = TbxSniffer::decode(f);
+
+	d->decode_time.add(monotonic_ns() - start);
+	return p;
+}
+
+/* The next frame of c passing the filter, without waiting */
+static SnifferFrame *pop_frame(Sniffer_private *d, SnifferConsumer *c)
+{
+	SnifferFrame *f;
+	peek_handler filter;
+
+	while (c->pop(&f)) {
+		if (!(filter = d->filter) || filter(f, d->filter_ctx))
+			return f;
+		++d->filtered;
+		TbxSniffer::release(f);
 	}
+	return NULL;
+}
 
-	if (!d->sniff)
+Crafter::Packet* TbxSniffer::recv(struct timespec *t, size_t consumer)
+{
+	SnifferFrame *f = recv_frame(t, consumer);
+
+	return f ? timed_decode(d, f) : NULL;
+}
+
+size_t TbxSniffer::recv_batch(std::vector<Crafter::Packet*> &pkts, size_t max,
+		struct timespec *t, size_t consumer)
+{
+	SnifferFrame *f;
+	size_t n = 0;
+
+	if (!max || !(f = recv_frame(t, consumer)))
+		return 0;
+	/* Then whatever is already queued */
+	do {
+		pkts.push_back(timed_decode(d, f));
+	} while (++n < max && (f = pop_frame(d, d->consumers[consumer])));
+	return n;
+}
+
+SnifferFrame* TbxSniffer::recv_frame(struct timespec *t, size_t consumer)
+{
+	struct timespec deadline;
+	SnifferFrame *f;
+	SnifferConsumer *c;
+
+	if (consumer >= d->consumers.size())
 		return NULL;
+	c = d->consumers[consumer];
+	if (t)
+		deadline_after(t, &deadline);
 
-	if ((err = pthread_mutex_lock(&d->mutex))) {
-		errno = err;
-		_crash("Sniffer::start::mutex_lock");
+	while (!(f = pop_frame(d, c))) {
+		if (!d->sniff || !c->wait(t ? &deadline : NULL))
+			return NULL;
 	}
-	Crafter::Packet *p = d->packets.front();
-	d->packets.pop();
-	if ((err = pthread_mutex_unlock(&d->mutex))) {
-		errno = err;
-		_crash("Sniffer::start::mutex_unlock");
+	return f;
+}
+
+Crafter::Packet* TbxSniffer::decode(SnifferFrame *f)
+{
+	Crafter::Packet *p;
+
+	/* Keep the timestamp of the kernel */
+	switch (f->lltype) {
+	case ETH_P_IP:
+		p = new Crafter::Packet(ns_timeval(ts_ns(f->ts)));
+		p->PacketFromIP(f->data, f->len);
+		break;
+	case ETH_P_IPV6:
+		p = new Crafter::Packet(ns_timeval(ts_ns(f->ts)));
+		p->PacketFromIPv6(f->data, f->len);
+		break;
+	default:
+		p = new Crafter::Packet(f->data, f->len, f->lltype);
 	}
+
+	release(f);
 	return p;
 }
+
+void TbxSniffer::release(SnifferFrame *f)
+{
+	SnifferPool::put(f);
+}
+
+void TbxSniffer::set_filter(peek_handler h, void *ctx)
+{
+	d->filter = NULL;
+	d->filter_ctx = ctx;
+	d->filter = h;
+}
+
+bool SnifferFrame::peek(SnifferHeaders *h) const
+{
+	const unsigned char *p = data;
+	uint32_t off;
+
+	if (len < 1)
+		return false;
+	h->sport = h->dport = -1;
+	switch (p[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return false;
+		h->version = 4;
+		h->proto = p[9];
+		h->src = p + 12;
+		h->dst = p + 16;
+		off = (p[0] & 0x0f) * 4;
+		/* Only the first fragment holds the ports */
+		if ((p[6] & 0x1f) || p[7])
+			return true;
+		break;
+	case 6:
+		if (len < 40)
+			return false;
+		h->version = 6;
+		h->proto = p[6];
+		h->src = p + 8;
+		h->dst = p + 24;
+		off = 40;
+		break;
+	default:
+		return false;
+	}
+	if ((h->proto == IPPROTO_TCP || h->proto == IPPROTO_UDP) &&
+			off + 4 <= len) {
+		h->sport = (p[off] << 8) | p[off + 1];
+		h->dport = (p[off + 2] << 8) | p[off + 3];
+	}
+	return true;
+}
+
+bool TbxSniffer::sniffing() const
+{
+	return d->sniff;
+}
+
+uint64_t TbxSniffer::dropped() const
+{
+	return d->dropped;
+}
+
+uint64_t TbxSniffer::overruns() const
+{
+	return d->overruns;
+}
+
+SnifferStats TbxSniffer::stats() const
+{
+	SnifferStats st;
+
+	st.received = 0;
+	st.queued = 0;
+	st.capacity = 0;
+	for (SnifferQueue *sq : d->queues)
+		st.received += sq->received.load(std::memory_order_relaxed);
+	for (SnifferConsumer *c : d->consumers)
+		for (SPSCRing<SnifferFrame*> *r : c->rings) {
+			st.queued += r->size();
+			st.capacity += r->capacity();
+		}
+	st.filtered = d->filtered;
+	st.dropped = d->dropped;
+	st.overruns = d->overruns;
+	d->decode_time.read(&st.decode);
+	d->callback_time.read(&st.callback);
+	return st;
+}
+
+uint64_t SnifferHistogram::quantile(double q) const
+{
+	uint64_t rank = q * count, seen = 0;
+
+	if (!count)
+		return 0;
+	for (size_t i = 0; i < SNIFFER_HIST_BUCKETS - 1; ++i) {
+		seen += buckets[i];
+		if (seen > rank)
+			return std::min((uint64_t)2 << i, max);
+	}
+	return max;
+}
+
+static void print_histogram(std::ostream &out, const char *name,
+		const SnifferHistogram &h)
+{
+	out << name << ": count=" << h.count;
+	if (!h.count) {
+		out << std::endl;
+		return;
+	}
+	out << " mean=" << h.sum / h.count << "ns p50=" << h.quantile(.5) <<
+		"ns p99=" << h.quantile(.99) << "ns max=" << h.max << "ns" <<
+		std::endl;
+}
+
+void SnifferStats::Print(std::ostream &out) const
+{
+	out << "received: " << received << std::endl;
+	out << "filtered: " << filtered << std::endl;
+	out << "dropped: " << dropped << std::endl;
+	out << "overruns: " << overruns << std::endl;
+	out << "queued: " << queued << "/" << capacity << std::endl;
+	print_histogram(out, "decode", decode);
+	print_histogram(out, "callback", callback);
+}
@@ -8,32 +8,205 @@
 #ifndef __SNIFFER_H_
 #define __SNIFFER_H_
 
+#include <ostream>
 #include <string>
+#include <stdint.h>
 #include "crafter/Packet.h"
 
 /* A callback function that will be called for each received packet.
  * If it returns anything but 0, it will stop the sniffer. */
 typedef int (*rcv_handler)(Crafter::Packet*, void*);
 
+/* The headers of a frame, pointing into it */
+struct SnifferHeaders {
+	/* 4 or 6 */
+	int version;
+	/* Protocol following the network header, IPv6 extension headers are
+	 * not skipped */
+	int proto;
+	/* -1 unless the packet is TCP or UDP and holds the ports, i.e. it is
+	 * not a later fragment */
+	int sport;
+	int dport;
+	/* 4 or 16 bytes long, depending on the version */
+	const unsigned char *src;
+	const unsigned char *dst;
+};
+
+class SnifferPool;
+
+/* A packet as received by the sniffer, before it is decoded */
+struct SnifferFrame {
+	/* From the network header onwards */
+	unsigned char *data;
+	uint32_t len;
+	/* Ethertype of the network header */
+	uint16_t lltype;
+	/* Set by the kernel as the packet was received, on CLOCK_REALTIME */
+	struct timespec ts;
+	/* Pool holding data, NULL if it was allocated on its own */
+	SnifferPool *pool;
+	SnifferFrame *next;
+
+	/* Locate the network and transport headers without decoding the
+	 * packet. Returns false if it is neither IPv4 nor IPv6. */
+	bool peek(SnifferHeaders *h) const;
+};
+
+/* Called on each frame before it is decoded, only the frames for which it
+ * returns true are received */
+typedef bool (*peek_handler)(const SnifferFrame*, void*);
+
+/* What to do with a packet received while the ring of the sniffer is full */
+enum SnifferOverflow {
+	/* Discard it */
+	SNIFFER_DROP_NEWEST,
+	/* Discard the oldest packet of the ring to make room for it */
+	SNIFFER_DROP_OLDEST,
+	/* Wait for the consumer to make room, leaving the next packets in the
+	 * kernel queue */
+	SNIFFER_BLOCK,
+};
+
+/* Where the packets come from */
+enum SnifferBackend {
+	/* Divert them to NFQUEUE through a firewall rule built from the key,
+	 * the sniffer then drops them */
+	SNIFFER_NFQUEUE,
+	/* Observe copies of them in TPACKET_V3 memory-mapped rings, through a
+	 * BPF filter built from the key, without touching the firewall */
+	SNIFFER_PACKET,
+};
+
+/* Number of packets queued between each netlink thread and each consumer */
+#define SNIFFER_DEFAULT_RING_SIZE 4096
+
+/* Enough for about a thousand full-sized packets */
+#define SNIFFER_DEFAULT_RCVBUF (2 * 1024 * 1024)
+
+struct SnifferConfig {
+	SnifferBackend backend;
+	/* Interface captured by SNIFFER_PACKET, all of them if empty */
+	std::string iface;
+	size_t ring_size;
+	SnifferOverflow overflow;
+	/* Number of NFQUEUE queues (or of packet sockets in a fanout group)
+	 * among which the kernel balances the flows. The sniffers with a
+	 * single queue, no cpu and no SNIFFER_BLOCK are all read by one
+	 * shared epoll thread, the queues of the others each get a thread of
+	 * their own. */
+	size_t queues;
+	/* Number of consumers, each packet going to the one given by the hash
+	 * of its flow */
+	size_t consumers;
+	/* CPU of the thread reading the first queue, the next ones being
+	 * pinned to the following CPUs. -1 to let the scheduler decide. */
+	int cpu;
+	/* Let the packets through instead of dropping them when the kernel
+	 * queue is full, for SNIFFER_NFQUEUE */
+	bool fail_open;
+	/* Size of the netlink socket buffers, 0 to keep the system default,
+	 * for SNIFFER_NFQUEUE */
+	int rcvbuf;
+
+	SnifferConfig() : backend(SNIFFER_NFQUEUE),
+		ring_size(SNIFFER_DEFAULT_RING_SIZE),
+		overflow(SNIFFER_DROP_NEWEST), queues(1), consumers(1), cpu(-1),
+		fail_open(false), rcvbuf(SNIFFER_DEFAULT_RCVBUF) {}
+};
+
+#define SNIFFER_HIST_BUCKETS 32
+
+/* Distribution of durations, in nsec */
+struct SnifferHistogram {
+	/* buckets[i] counts the durations in [2^i, 2^(i+1)), the first one
+	 * also holds 0 and the last one anything longer */
+	uint64_t buckets[SNIFFER_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	/* Upper bound of the bucket holding the q-quantile, 0 <= q <= 1 */
+	uint64_t quantile(double q) const;
+};
+
+/* Counters of a sniffer since it was created */
+struct SnifferStats {
+	/* Packets read from the kernel */
+	uint64_t received;
+	/* Packets discarded by the peek_handler */
+	uint64_t filtered;
+	/* See TbxSniffer::dropped() and TbxSniffer::overruns() */
+	uint64_t dropped;
+	uint64_t overruns;
+	/* Packets waiting in the rings, and their total capacity */
+	uint64_t queued;
+	uint64_t capacity;
+	/* Time spent decoding the frames received with recv() */
+	SnifferHistogram decode;
+	/* Time spent in the rcv_handler */
+	SnifferHistogram callback;
+
+	void Print(std::ostream &out) const;
+};
+
 struct Sniffer_private;
 class TbxSniffer {
 	Sniffer_private *d;
 
 	public:
 	/* Create a Sniffer object,
-	 * with the given key as iptable filter and callback fucntion*/
-	TbxSniffer(const std::vector<const char*>&);
+	 * with the given key as iptable filter and callback fucntion.
+	 * SNIFFER_PACKET only supports the -p, --sport and --dport options. */
+	TbxSniffer(const std::vector<const char*>&,
+			const SnifferConfig& = SnifferConfig());
 	~TbxSniffer();
 
 	/* Start sniffing the network. Will call the rcv_handler for each new packet,
-	 * with the given argument as last parameter */
+	 * with the given argument as last parameter. With several consumers,
+	 * the handler is called concurrently from one thread per consumer. */
 	int start(rcv_handler, void*);
 	/* Start sniffing the network. */
 	int start();
-	/* Retrieve a received packet, blocking if t is NULL */
-	Crafter::Packet* recv(struct timespec *t);
+	/* Wait until one of the started sniffers has a packet for its first
+	 * consumer, or is halted, for at most the relative timeout t, or
+	 * forever if t is NULL. Returns its index, or -1 on timeout. */
+	static int wait(const std::vector<TbxSniffer*>&, struct timespec *t);
+	/* Retrieve a packet delivered to the given consumer, waiting at most
+	 * for the relative timeout t, or blocking if t is NULL */
+	Crafter::Packet* recv(struct timespec *t, size_t consumer = 0);
+	/* Same as recv(), then append to pkts up to max - 1 more packets that
+	 * are already queued, without waiting for them. Returns the number of
+	 * packets appended, 0 on timeout. */
+	size_t recv_batch(std::vector<Crafter::Packet*> &pkts, size_t max,
+			struct timespec *t, size_t consumer = 0);
+	/* Same as recv(), without decoding the packet. The frame must be
+	 * given to decode() or release() before the sniffer is destroyed. */
+	SnifferFrame* recv_frame(struct timespec *t, size_t consumer = 0);
+
+	/* Build the packet of a frame, and release the frame */
+	static Crafter::Packet* decode(SnifferFrame *f);
+	static void release(SnifferFrame *f);
+
+	/* Discard the frames for which h returns false, before decoding them.
+	 * h is called by the consumers, NULL to receive all the frames. */
+	void set_filter(peek_handler h, void *ctx);
+
+	/* Number of packets discarded because the ring was full, whether
+	 * they were the newest or the oldest one */
+	uint64_t dropped() const;
+
+	/* Number of times netlink messages were lost because the socket
+	 * buffer was full (ENOBUFS), or number of packets lost because the
+	 * memory-mapped ring was full */
+	uint64_t overruns() const;
+
+	/* Can be called from any thread, while sniffing */
+	SnifferStats stats() const;
 
 	void stop();
+	/* Between start() and stop(), unless it was interrupted */
+	bool sniffing() const;
 };
 
 #endif
@@ -12,28 +12,31 @@
 #include <memory>
 
 #include "crafter.h"
-#include "config.h"
 #include "PacketModification.h"
+#include "TraceSession.h"
 
-extern double tbx_default_timeout;
 extern bool print_debug;
 
+/* Called for each hop with the context given to doTracebox(), the address
+ * of the router that replied, or an empty string, and the modifications,
+ * which the callback owns. Anything but 0 stops the trace. */
 typedef int (tracebox_cb_t)(void *, uint8_t, std::string&, PacketModifications *);
 
-IPLayer* probe_sanity_check(const Crafter::Packet *probe,
-		std::string& err, std::string& iface);
-
-int doTracebox(std::shared_ptr<Crafter::Packet> pkt, tracebox_cb_t *callback,
-		std::string& err, void *ctx = NULL);
-
-int set_tracebox_ttl_range(uint8_t ttl_min, uint8_t ttl_max);
-uint8_t get_min_ttl();
-uint8_t get_max_ttl();
-
-void writePcap(Packet* p);
-
-#ifdef HAVE_CURL
-void curlPost(const char *pcap_filename, const char *url);
-#endif
+/* A probe with the given network and transport protocols (e.g.
+ * IP::PROTO and TCP::PROTO) and random identifiers, lacking the addresses */
+Crafter::Packet *BuildProbe(int net, int tr, int dport);
+
+/* Complete the addresses of the probe, and set iface to the interface
+ * of the route to its destination if it is empty */
+IPLayer* probe_sanity_check(const TraceSession &s,
+		const Crafter::Packet *probe, std::string& err, std::string& iface);
+
+/* Send the probe with the TTLs of the session, calling the callback with
+ * ctx for each of them. If incremental is set, the modifications of each
+ * hop are computed against the quote of the previous responsive hop
+ * instead of the original probe */
+int doTracebox(TraceSession &s, std::shared_ptr<Crafter::Packet> pkt,
+		tracebox_cb_t *callback, std::string& err, void *ctx = NULL,
+		bool incremental = false);
 
 #endif
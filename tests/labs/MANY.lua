@@ -0,0 +1,19 @@
+--
+-- Tracebox -- A middlebox detection tool
+--
+--  Copyright 2013-2015 by its authors.
+--  Some rights reserved. See LICENSE, AUTHORS.
+--
+
+-- The traces run one after the other when replaying a pcap file
+local hops = {0, 0}
+local res = tracebox_many({IP / tcp{dst=80} / MSS, IP / tcp{dst=443} / MSS},
+	{callback = function(ttl, rip, mods, i)
+		assert(i == 1 or i == 2)
+		hops[i] = hops[i] + 1
+		print(i .. ": " .. ttl .. " " .. rip .. " " ..
+			tostring(mods:has("TCPOption::MSS")))
+	end})
+
+assert(#res == 2)
+assert(hops[1] == 2 and hops[2] == 2)
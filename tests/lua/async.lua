@@ -0,0 +1,50 @@
+--
+-- Tracebox -- A middlebox detection tool
+--
+--  Copyright 2013-2015 by its authors.
+--  Some rights reserved. See LICENSE, AUTHORS.
+--
+
+-- The coroutines run in turn when they yield
+local steps = {}
+for i = 1, 2 do
+	async(function(n)
+		table.insert(steps, n)
+		coroutine.yield()
+		table.insert(steps, n)
+	end, i)
+end
+run_async()
+assert(#steps == 4)
+assert(steps[1] == 1 and steps[2] == 2 and steps[3] == 1 and steps[4] == 2)
+
+-- Their errors are printed, and do not stop the others
+local done = false
+async(function() error("expected error") end)
+async(function() done = true end)
+run_async()
+assert(done)
+
+local nested
+async(function() nested = pcall(run_async) end)
+run_async()
+assert(nested == false)
+
+assert(not pcall(set_async_threads, 0))
+local n = set_async_threads(4)
+assert(set_async_threads(n) == 4)
+
+-- The callbacks are checked before anything is sent
+local probe = ip{dst="127.0.0.1"} / TCP
+
+local function argerror(msg, fn, ...)
+	local ok, err = pcall(fn, ...)
+	assert(not ok and err:find(msg, 1, true))
+end
+
+argerror("callback is not a function", tracebox, probe, {callback = 1})
+argerror("callback is not a function", tracebox_many, {probe},
+	{callback = {}})
+argerror("result must be a function", tracebox_many, {probe}, {result = 1})
+argerror("result must be a function", Packet.sendrecv_many, {probe},
+	{result = "none"})
@@ -0,0 +1,113 @@
+--
+-- Tracebox -- A middlebox detection tool
+--
+--  Copyright 2013-2015 by its authors.
+--  Some rights reserved. See LICENSE, AUTHORS.
+--
+
+function diff(orig, recv)
+	return tostring(PacketModifications.new(orig, recv))
+end
+
+-- Options are compared one by one
+m = diff(IP / TCP / MSS / WSCALE, IP / TCP / mss(1200) / WSCALE)
+assert(m:find("TCPOption::MSS", 1, true))
+assert(not m:find("WScale", 1, true))
+
+m = diff(IP / TCP / MSS / WSCALE, IP / TCP / MSS / NOP / NOP / NOP / NOP)
+assert(m:find("-TCPOption::WScale", 1, true))
+assert(not m:find("TCPOption::MSS", 1, true))
+
+m = diff(IP / TCP / MSS / NOP / NOP / NOP / NOP, IP / TCP / MSS / WSCALE)
+assert(m:find("+TCPOption::WScale", 1, true))
+
+-- Only the options that moved are reordered
+m = diff(IP / TCP / MSS / WSCALE, IP / TCP / WSCALE / MSS)
+assert(m:find("~TCPOption::MSS", 1, true))
+assert(not m:find("~TCPOption::WScale", 1, true))
+
+m = diff(IP / TCP / MSS / SACKP / TS / WSCALE,
+	IP / TCP / SACKP / TS / WSCALE / MSS)
+assert(m:find("~TCPOption::MSS", 1, true))
+assert(not m:find("~TCPOption::SACKP", 1, true))
+assert(not m:find("~TCPOption::TS", 1, true))
+assert(not m:find("~TCPOption::WScale", 1, true))
+
+m = diff(IP / TCP / MPCAPABLE, IP / TCP / MPJOIN)
+assert(m:find("-TCPOption::MPCapable", 1, true))
+assert(m:find("+TCPOption::MPJoin", 1, true))
+
+-- IPv6 and UDP headers are compared field by field
+m = diff(ipv6{dst = "::1", hoplimit = 4} / UDP,
+	ipv6{dst = "::2", hoplimit = 3} / UDP)
+assert(m:find("IPv6::HopLimit", 1, true))
+assert(m:find("IPv6::DestinationIP", 1, true))
+assert(not m:find("IPv6::FlowLabel", 1, true))
+assert(not m:find("UDP::DstPort", 1, true))
+
+-- ICMP errors are compared on the packet they quote
+probe = IP / TCP / MSS
+reply = IP / ICMP.new{type = 11} / Raw.new((IP / TCP / mss(1200)):bytes())
+mods = PacketModifications.new(probe, reply)
+m = tostring(mods)
+assert(m:find("TCPOption::MSS", 1, true))
+assert(not m:find("ICMP", 1, true))
+assert(mods:received():tcp())
+assert(not mods:received():icmp())
+
+-- ICMP extensions are decoded, here an MPLS label stack found after the
+-- first 128 bytes of the quote
+q = (IP / TCP):bytes()
+for i = #q + 1, 128 do q[i] = 0 end
+for _, b in ipairs({0x20, 0, 0, 0, 0, 8, 1, 1, 0x03, 0xe8, 0x11, 0x01}) do
+	q[#q + 1] = b
+end
+mods = PacketModifications.new(IP / TCP, IP / ICMP.new{type = 11} / Raw.new(q))
+ext = mods:extensions()
+assert(#ext == 1 and ext[1].name == "MPLS")
+assert(ext[1].labels[1].label == 16001)
+assert(ext[1].labels[1].s and ext[1].labels[1].ttl == 1)
+assert(tostring(mods):find("[Extra headers: MPLS", 1, true))
+
+-- Identical sets of modifications share the same pattern
+a = PacketModifications.new(IP / TCP / MSS, IP / TCP / mss(1200))
+b = PacketModifications.new(IP / TCP / MSS, IP / TCP / mss(1200))
+c = PacketModifications.new(IP / TCP / MSS, IP / TCP)
+assert(a:pattern() == b:pattern())
+assert(a:pattern() ~= c:pattern())
+assert(modification_pattern(a:pattern()) == a:fingerprint())
+
+-- Compact modifications only keep the records and the start of the quote
+set_packet_ring(2)
+mods = PacketModifications.new(IP / TCP / MSS,
+	IP / ICMP.new{type = 11} / Raw.new((IP / TCP / mss(1200)):bytes()))
+m = tostring(mods)
+mods:compact(20)
+assert(mods:is_compact())
+assert(tostring(mods) == m)
+assert(mods:router() and mods:rtt())
+assert(#mods:snippet() == 20 and mods:snippet()[1] == 0x45)
+assert(not mods:original() and not mods:received())
+assert(#packet_ring() == 1 and packet_ring()[1].received:icmp())
+set_packet_ring(0)
+
+-- The modifications can be queried without formatting them
+mods = PacketModifications.new(IP / TCP / MSS / WSCALE,
+	IP / TCP / mss(1200) / NOP / NOP / NOP / NOP)
+assert(mods:has("TCPOption::MSS") and mods:has("TCPOption"))
+assert(mods:has("-TCPOption::WScale") and not mods:has("+TCPOption::WScale"))
+assert(not mods:has("IP::TTL") and not mods:has("IP"))
+assert(#mods:removed() == 1 and mods:removed()[1] == "TCPOption::WScale")
+assert(#mods:added() == 0)
+n = 0
+for layer, field, off, len, old, new in mods:records() do
+	if field == "MSS" then
+		assert(layer == "TCPOption" and len == 32)
+		assert(old == "1460" and new == "1200")
+		n = n + 1
+	elseif field == "WScale" then
+		assert(layer == "TCPOption" and old and not new)
+		n = n + 1
+	end
+end
+assert(n == 2)
@@ -33,3 +33,8 @@ pkt = ip{dst='1.2.3.4'}/tcp{dst=40}
 assert(pkt:get(IP):dest() == '1.2.3.4')
 assert(pkt:get(TCP):getdest() == 40)
 assert(pkt:get(MPCAPABLE) == nil)
+
+pkt = IP/TCP/NOP/MSS/NOP/wscale(7)
+assert(#pkt:getall(NOP) == 2)
+assert(#pkt:getall(UDP) == 0)
+assert(pkt:get(MSS) ~= nil)